@@ -0,0 +1,450 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-bench.c
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  DMA throughput and latency benchmark. Sweeps transfer
+**                size, direction, interrupt / polling mode and number of
+**                competing processes, and prints one CSV (or JSON) record
+**                per combination. Runs against the hardware or against
+**                the emulated device of crash-emu.ko.
+**
+**                S2MM transfers need a source feeding the DMA on the
+**                chosen TDEST, e.g. the USRP interface in
+**                RX_TEST_PATTERN_MODE. The emulator always has one.
+**
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "crash-kmod.h"
+
+#define BENCH_MAX_POINTS          32
+#define BENCH_MAX_SAMPLES         (1 << 18)   // Latencies kept per process and direction
+#define BENCH_DIR_BOTH            CRASH_NUM_DIRS
+
+struct bench_config {
+  const char  *dev;
+  uint32_t    sizes[BENCH_MAX_POINTS];
+  int         nsizes;
+  int         dirs[BENCH_MAX_POINTS];         // CRASH_DIR_MM2S, CRASH_DIR_S2MM or BENCH_DIR_BOTH
+  int         ndirs;
+  int         irqs[2];                        // Interrupt modes to run, 1 = interrupts, 0 = polling
+  int         nirqs;
+  int         procs[BENCH_MAX_POINTS];
+  int         nprocs;
+  double      seconds;                        // Run time of each combination
+  uint32_t    tdest;
+  uint32_t    timeout_us;
+  int         json;
+};
+
+// Results of one process and direction, in memory shared with the parent
+struct bench_result {
+  uint64_t    xfers;
+  uint64_t    bytes;
+  uint64_t    errors;
+  uint64_t    nsamples;
+  uint32_t    lat_ns[BENCH_MAX_SAMPLES];
+};
+
+struct bench_worker {
+  int                   fd;
+  int                   dir;
+  uint32_t              size;
+  const struct bench_config *cfg;
+  struct timespec       stop;
+  struct bench_result   *res;
+};
+
+static uint64_t bench_ns(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return bench_ns(&ts);
+}
+
+// Back to back blocking DMAs until the deadline
+static void *bench_worker_run(void *arg)
+{
+  struct bench_worker *w = arg;
+  struct bench_result *res = w->res;
+  struct crash_dma_xfer x;
+  uint64_t stop = bench_ns(&w->stop);
+  uint64_t start, end;
+
+  do {
+    memset(&x, 0, sizeof(struct crash_dma_xfer));
+    x.dir = w->dir;
+    x.buff = w->dir;
+    x.cmd_data = (w->size << DMA_S2MM_CMD_SIZE_OFFSET) |
+                 (w->cfg->tdest << DMA_S2MM_CMD_TDEST_OFFSET) |
+                 (1U << DMA_S2MM_CMD_EN_OFFSET);
+    x.timeout_us = w->cfg->timeout_us;
+    x.spin_us = CRASH_SPIN_DEFAULT;
+    start = bench_now_ns();
+    if (ioctl(w->fd, CRASH_DMA_XFER, &x) < 0) {
+      end = bench_now_ns();
+      res->errors++;
+      // A missing source times out every transfer, do not spin on it
+      if (errno != ETIMEDOUT && errno != EINTR) break;
+      continue;
+    }
+    end = bench_now_ns();
+    if (res->nsamples < BENCH_MAX_SAMPLES) {
+      res->lat_ns[res->nsamples++] = (end - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(end - start);
+    }
+    res->xfers++;
+    res->bytes += w->size;
+  } while (end < stop);
+  return NULL;
+}
+
+// One competing process: its own file descriptor and buffers, one thread per direction
+static int bench_child(const struct bench_config *cfg, int dir, uint32_t size, int go,
+                       struct bench_result *res)
+{
+  struct bench_worker w[CRASH_NUM_DIRS];
+  pthread_t thread[CRASH_NUM_DIRS];
+  struct crash_buff_alloc alloc;
+  uint64_t stop;
+  char c;
+  int fd, i, n;
+
+  fd = open(cfg->dev, O_RDWR);
+  if (fd < 0) {
+    perror(cfg->dev);
+    return 1;
+  }
+  // Buffer 0 for MM2S, buffer 1 for S2MM
+  memset(&alloc, 0, sizeof(struct crash_buff_alloc));
+  alloc.count = CRASH_NUM_DIRS;
+  alloc.size = size;
+  alloc.mode = CRASH_BUFF_COHERENT;
+  if (ioctl(fd, CRASH_ALLOC_BUFFS, &alloc) < 0) {
+    perror("CRASH_ALLOC_BUFFS");
+    close(fd);
+    return 1;
+  }
+
+  // Start with every other process
+  while (read(go, &c, 1) < 0 && errno == EINTR);
+  stop = bench_now_ns() + (uint64_t)(cfg->seconds * 1e9);
+
+  n = 0;
+  for (i = 0; i < CRASH_NUM_DIRS; i++) {
+    if (dir != BENCH_DIR_BOTH && dir != i) continue;
+    w[n].fd = fd;
+    w[n].dir = i;
+    w[n].size = size;
+    w[n].cfg = cfg;
+    w[n].stop.tv_sec = stop / 1000000000ULL;
+    w[n].stop.tv_nsec = stop % 1000000000ULL;
+    w[n].res = &res[i];
+    if (pthread_create(&thread[n], NULL, bench_worker_run, &w[n])) {
+      fprintf(stderr, "crash-bench: pthread_create failed\n");
+      break;
+    }
+    n++;
+  }
+  for (i = 0; i < n; i++) {
+    pthread_join(thread[i], NULL);
+  }
+  close(fd);
+  return 0;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double bench_pct_us(const uint32_t *lat, uint64_t n, double p)
+{
+  uint64_t i;
+
+  if (n == 0) return 0.0;
+  i = (uint64_t)(p * (n - 1) + 0.5);
+  return lat[i] / 1000.0;
+}
+
+static void bench_print_header(const struct bench_config *cfg)
+{
+  if (cfg->json) return;
+  printf("dir,irq,procs,size,xfers,errors,seconds,mb_s,xfers_s,p50_us,p99_us,p999_us\n");
+}
+
+static void bench_print(const struct bench_config *cfg, const char *dir, int irq, int procs,
+                        uint32_t size, uint64_t xfers, uint64_t bytes, uint64_t errors,
+                        double secs, const uint32_t *lat, uint64_t nlat)
+{
+  double mb_s = bytes / secs / 1e6;
+  double xfers_s = xfers / secs;
+  double p50 = bench_pct_us(lat, nlat, 0.50);
+  double p99 = bench_pct_us(lat, nlat, 0.99);
+  double p999 = bench_pct_us(lat, nlat, 0.999);
+
+  if (cfg->json) {
+    printf("{\"dir\":\"%s\",\"irq\":%d,\"procs\":%d,\"size\":%u,\"xfers\":%llu,\"errors\":%llu,"
+           "\"seconds\":%.3f,\"mb_s\":%.3f,\"xfers_s\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+           dir, irq, procs, size, (unsigned long long)xfers, (unsigned long long)errors,
+           secs, mb_s, xfers_s, p50, p99, p999);
+  } else {
+    printf("%s,%d,%d,%u,%llu,%llu,%.3f,%.3f,%.1f,%.3f,%.3f,%.3f\n",
+           dir, irq, procs, size, (unsigned long long)xfers, (unsigned long long)errors,
+           secs, mb_s, xfers_s, p50, p99, p999);
+  }
+  fflush(stdout);
+}
+
+// Run one combination and print a record per direction it used
+static int bench_point(const struct bench_config *cfg, int ctl, int dir, int irq, int procs, uint32_t size)
+{
+  struct bench_result *res;
+  size_t res_len = sizeof(struct bench_result) * CRASH_NUM_DIRS * procs;
+  uint32_t *lat;
+  uint64_t xfers, bytes, errors, nlat, start, elapsed;
+  int pipefd[2];
+  pid_t pid;
+  int i, p, status, failed = 0;
+
+  // DMA_BANK1: bit 0 S2MM interrupt, bit 1 MM2S interrupt
+  if (ioctl(ctl, CRASH_SET_INTERRUPTS, irq ? 0x3 : 0x0) < 0) {
+    perror("CRASH_SET_INTERRUPTS");
+    return -1;
+  }
+
+  res = mmap(NULL, res_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (res == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  memset(res, 0, res_len);
+  if (pipe(pipefd) < 0) {
+    perror("pipe");
+    munmap(res, res_len);
+    return -1;
+  }
+
+  for (p = 0; p < procs; p++) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      failed = 1;
+      break;
+    }
+    if (pid == 0) {
+      close(pipefd[1]);
+      _exit(bench_child(cfg, dir, size, pipefd[0], &res[p * CRASH_NUM_DIRS]));
+    }
+  }
+  // Closing the pipe releases every child at once
+  close(pipefd[0]);
+  start = bench_now_ns();
+  close(pipefd[1]);
+  while ((pid = wait(&status)) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+  }
+  elapsed = bench_now_ns() - start;
+  if (failed) {
+    munmap(res, res_len);
+    return -1;
+  }
+
+  lat = malloc(sizeof(uint32_t) * BENCH_MAX_SAMPLES * procs);
+  if (!lat) {
+    munmap(res, res_len);
+    return -1;
+  }
+  for (i = 0; i < CRASH_NUM_DIRS; i++) {
+    if (dir != BENCH_DIR_BOTH && dir != i) continue;
+    xfers = bytes = errors = nlat = 0;
+    for (p = 0; p < procs; p++) {
+      struct bench_result *r = &res[p * CRASH_NUM_DIRS + i];
+
+      xfers += r->xfers;
+      bytes += r->bytes;
+      errors += r->errors;
+      memcpy(&lat[nlat], r->lat_ns, sizeof(uint32_t) * r->nsamples);
+      nlat += r->nsamples;
+    }
+    qsort(lat, nlat, sizeof(uint32_t), bench_cmp_u32);
+    bench_print(cfg, (i == CRASH_DIR_S2MM) ? "s2mm" : "mm2s", irq, procs, size, xfers, bytes, errors, elapsed / 1e9, lat, nlat);
+  }
+  free(lat);
+  munmap(res, res_len);
+  return 0;
+}
+
+// Comma separated list of numbers, with optional k / M suffixes
+static int bench_parse_list(const char *s, uint32_t *out, int max)
+{
+  char *end;
+  unsigned long v;
+  int n = 0;
+
+  while (*s) {
+    if (n == max) return -1;
+    v = strtoul(s, &end, 0);
+    if (end == s) return -1;
+    if (*end == 'k' || *end == 'K') { v <<= 10; end++; }
+    else if (*end == 'M') { v <<= 20; end++; }
+    out[n++] = v;
+    if (*end == ',') end++;
+    else if (*end) return -1;
+    s = end;
+  }
+  return n;
+}
+
+static void bench_usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -d dev       device (/dev/crash)\n"
+    "  -s sizes     transfer sizes in bytes, k / M suffixes (4k,64k,1M)\n"
+    "  -D dirs      mm2s, s2mm and / or both (mm2s,s2mm,both)\n"
+    "  -m modes     irq and / or poll (irq,poll)\n"
+    "  -p procs     numbers of competing processes (1,2,4)\n"
+    "  -t seconds   run time of each combination (1)\n"
+    "  -T tdest     TDEST of the DMA commands (0)\n"
+    "  -w usec      per transfer deadline, 0 for the driver default (0)\n"
+    "  -j           JSON lines instead of CSV\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+  struct bench_config cfg;
+  uint32_t procs[BENCH_MAX_POINTS];
+  char *tok, *save;
+  int opt, ctl, s, d, m, p, result = 0;
+
+  memset(&cfg, 0, sizeof(struct bench_config));
+  cfg.dev = "/dev/" MODULE_NAME;
+  cfg.sizes[0] = 4096; cfg.sizes[1] = 65536; cfg.sizes[2] = 1 << 20;
+  cfg.nsizes = 3;
+  cfg.dirs[0] = CRASH_DIR_MM2S; cfg.dirs[1] = CRASH_DIR_S2MM; cfg.dirs[2] = BENCH_DIR_BOTH;
+  cfg.ndirs = 3;
+  cfg.irqs[0] = 1; cfg.irqs[1] = 0;
+  cfg.nirqs = 2;
+  cfg.procs[0] = 1; cfg.procs[1] = 2; cfg.procs[2] = 4;
+  cfg.nprocs = 3;
+  cfg.seconds = 1.0;
+
+  while ((opt = getopt(argc, argv, "d:s:D:m:p:t:T:w:jh")) != -1) {
+    switch (opt) {
+      case 'd':
+        cfg.dev = optarg;
+        break;
+      case 's':
+        cfg.nsizes = bench_parse_list(optarg, cfg.sizes, BENCH_MAX_POINTS);
+        if (cfg.nsizes <= 0) goto usage;
+        break;
+      case 'D':
+        cfg.ndirs = 0;
+        for (tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+          if (cfg.ndirs == BENCH_MAX_POINTS) goto usage;
+          if (!strcmp(tok, "mm2s"))      cfg.dirs[cfg.ndirs++] = CRASH_DIR_MM2S;
+          else if (!strcmp(tok, "s2mm")) cfg.dirs[cfg.ndirs++] = CRASH_DIR_S2MM;
+          else if (!strcmp(tok, "both")) cfg.dirs[cfg.ndirs++] = BENCH_DIR_BOTH;
+          else goto usage;
+        }
+        if (cfg.ndirs == 0) goto usage;
+        break;
+      case 'm':
+        cfg.nirqs = 0;
+        for (tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+          if (cfg.nirqs == 2) goto usage;
+          if (!strcmp(tok, "irq"))       cfg.irqs[cfg.nirqs++] = 1;
+          else if (!strcmp(tok, "poll")) cfg.irqs[cfg.nirqs++] = 0;
+          else goto usage;
+        }
+        if (cfg.nirqs == 0) goto usage;
+        break;
+      case 'p':
+        cfg.nprocs = bench_parse_list(optarg, procs, BENCH_MAX_POINTS);
+        if (cfg.nprocs <= 0) goto usage;
+        for (p = 0; p < cfg.nprocs; p++) {
+          if (procs[p] == 0 || procs[p] > 256) goto usage;
+          cfg.procs[p] = procs[p];
+        }
+        break;
+      case 't':
+        cfg.seconds = atof(optarg);
+        if (cfg.seconds <= 0) goto usage;
+        break;
+      case 'T':
+        cfg.tdest = strtoul(optarg, NULL, 0);
+        if (cfg.tdest >= CRASH_NUM_TDEST) goto usage;
+        break;
+      case 'w':
+        cfg.timeout_us = strtoul(optarg, NULL, 0);
+        break;
+      case 'j':
+        cfg.json = 1;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  for (s = 0; s < cfg.nsizes; s++) {
+    if (cfg.sizes[s] == 0 || cfg.sizes[s] > CRASH_MAX_BUFF_SIZE ||
+        cfg.sizes[s] >= (1U << DMA_S2MM_CMD_SIZE_N)) {
+      fprintf(stderr, "crash-bench: size %u out of range\n", cfg.sizes[s]);
+      return 1;
+    }
+  }
+
+  // Held open for the whole run to set the interrupt mode
+  ctl = open(cfg.dev, O_RDWR);
+  if (ctl < 0) {
+    perror(cfg.dev);
+    return 1;
+  }
+  bench_print_header(&cfg);
+  for (m = 0; m < cfg.nirqs && !result; m++) {
+    for (d = 0; d < cfg.ndirs && !result; d++) {
+      for (p = 0; p < cfg.nprocs && !result; p++) {
+        for (s = 0; s < cfg.nsizes && !result; s++) {
+          result = bench_point(&cfg, ctl, cfg.dirs[d], cfg.irqs[m], cfg.procs[p], cfg.sizes[s]);
+        }
+      }
+    }
+  }
+  close(ctl);
+  return result ? 1 : 0;
+
+usage:
+  bench_usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,491 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-capture.c
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  Sustained RX to disk recorder. A reader thread takes
+**                filled slots off the S2MM streaming ring and copies
+**                them into a large single producer / single consumer
+**                ring of aligned buffers, which a writer thread drains
+**                to the output file with O_DIRECT writes. Prints the
+**                sustained rate, buffers dropped because the disk fell
+**                behind and USRP_RX_FIFO_OVERFLOW events once per
+**                interval.
+**
+**                The USRP interface must already be streaming RX data
+**                on the chosen TDEST, only the CIC decimation can be
+**                set from here.
+**
+******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "crash-kmod.h"
+
+#define CAP_ALIGN                 4096        // O_DIRECT buffer and length alignment
+
+struct cap_config {
+  const char  *dev;
+  const char  *out;
+  uint32_t    slot_size;                      // Bytes per DMA and per file write
+  uint32_t    ring_slots;                     // Slots of the S2MM streaming ring
+  uint32_t    bufs;                           // Buffers between the reader and the writer
+  uint32_t    tdest;
+  int         decim;                          // USRP_RX_CIC_DECIM to set, -1 to leave alone
+  int         reader_cpu;                     // -1 for no pinning
+  int         writer_cpu;
+  int         direct;                         // Open the output with O_DIRECT
+  double      seconds;                        // 0 runs until SIGINT / SIGTERM
+  double      interval;                       // Seconds between reports
+  int         json;
+};
+
+// Reader to writer ring. head is only written by the reader, tail only by the writer.
+struct cap_ring {
+  uint8_t           *mem;
+  uint32_t          nbufs;
+  uint32_t          buf_size;
+  _Atomic uint64_t  head;
+  _Atomic uint64_t  tail;
+};
+
+struct cap_state {
+  const struct cap_config   *cfg;
+  int                       fd;
+  int                       out;
+  struct crash_ring_ctrl    *ctrl;            // S2MM streaming ring mapping
+  size_t                    ring_len;
+  const struct crash_status_page *status;
+  struct cap_ring           ring;
+  _Atomic uint64_t          dropped;          // Slots thrown away because the ring was full
+  _Atomic uint64_t          written;          // Bytes on disk
+  _Atomic int               error;            // First errno of a thread, stops the run
+  _Atomic int               reader_done;      // Nothing more will be queued for the writer
+};
+
+static volatile sig_atomic_t cap_stop;
+
+static void cap_signal(int sig)
+{
+  (void)sig;
+  cap_stop = 1;
+}
+
+static uint64_t cap_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cap_pin(int cpu, const char *who)
+{
+  cpu_set_t set;
+
+  if (cpu < 0) return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)) {
+    fprintf(stderr, "crash-capture: could not pin the %s thread to CPU %d\n", who, cpu);
+  }
+}
+
+static void cap_fail(struct cap_state *st, int err)
+{
+  int zero = 0;
+
+  atomic_compare_exchange_strong(&st->error, &zero, err);
+}
+
+// RX FIFO overflows counted by the driver, read under the status page sequence count
+static uint32_t cap_rx_overflows(const struct crash_status_page *s)
+{
+  uint32_t seq, n;
+
+  do {
+    seq = s->seq;
+    atomic_thread_fence(memory_order_acquire);
+    n = s->rx_overflows;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) || seq != s->seq);
+  return n;
+}
+
+// Producer: S2MM ring slots into the writer ring. Never stalls the DMA on the disk, a slot that
+// finds the writer ring full is dropped.
+static void *cap_reader(void *arg)
+{
+  struct cap_state *st = arg;
+  struct crash_ring_ctrl *ctrl = st->ctrl;
+  struct cap_ring *ring = &st->ring;
+  uint8_t *slots = (uint8_t *)ctrl + ctrl->data_offset;
+  uint64_t head = 0, tail;
+  uint32_t rtail = ctrl->tail;
+
+  cap_pin(st->cfg->reader_cpu, "reader");
+  while (!cap_stop && !atomic_load(&st->error)) {
+    if (rtail == ctrl->head) {
+      // Sleeps until a slot fills, CRASH_RING_WAIT also kicks a stalled ring
+      if (ioctl(st->fd, CRASH_RING_WAIT, CRASH_DIR_S2MM) < 0 && errno != ETIMEDOUT && errno != EINTR) {
+        perror("CRASH_RING_WAIT");
+        cap_fail(st, errno);
+      }
+      continue;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ring->nbufs) {
+      atomic_fetch_add_explicit(&st->dropped, 1, memory_order_relaxed);
+    } else {
+      memcpy(ring->mem + (head % ring->nbufs) * ring->buf_size,
+             slots + (size_t)(rtail % ctrl->nslots) * ctrl->slot_size, ring->buf_size);
+      atomic_store_explicit(&ring->head, ++head, memory_order_release);
+    }
+
+    // Done with the slot, hand it back to the DMA
+    atomic_thread_fence(memory_order_release);
+    ctrl->tail = ++rtail;
+    if (ctrl->flags & CRASH_RING_NEED_KICK) ioctl(st->fd, CRASH_RING_KICK, CRASH_DIR_S2MM);
+  }
+  atomic_store(&st->reader_done, 1);
+  return NULL;
+}
+
+// Consumer: writer ring to disk, one write per buffer
+static void *cap_writer(void *arg)
+{
+  struct cap_state *st = arg;
+  struct cap_ring *ring = &st->ring;
+  uint64_t tail = 0, head;
+  const struct timespec idle = { 0, 100000 };
+  ssize_t n;
+
+  cap_pin(st->cfg->writer_cpu, "writer");
+  for (;;) {
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+      // Drain what was captured before stopping
+      if (atomic_load(&st->reader_done) || atomic_load(&st->error)) break;
+      nanosleep(&idle, NULL);
+      continue;
+    }
+    n = write(st->out, ring->mem + (tail % ring->nbufs) * ring->buf_size, ring->buf_size);
+    if (n != (ssize_t)ring->buf_size) {
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        perror("write");
+        cap_fail(st, errno);
+      } else {
+        fprintf(stderr, "crash-capture: short write, disk full?\n");
+        cap_fail(st, ENOSPC);
+      }
+      break;
+    }
+    atomic_fetch_add_explicit(&st->written, n, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void cap_report(const struct cap_config *cfg, double t, double mb_s, uint64_t written,
+                       uint64_t dropped, uint32_t overflows, uint32_t fill, int final)
+{
+  if (cfg->json) {
+    printf("{\"final\":%d,\"seconds\":%.3f,\"mb_s\":%.3f,\"bytes\":%llu,\"dropped\":%llu,"
+           "\"rx_overflows\":%u,\"ring_fill\":%u}\n",
+           final, t, mb_s, (unsigned long long)written, (unsigned long long)dropped, overflows, fill);
+  } else {
+    printf("%s%8.1f s  %9.3f MB/s  %12llu bytes  dropped %llu  rx_overflows %u  ring %u/%u\n",
+           final ? "total " : "", t, mb_s, (unsigned long long)written, (unsigned long long)dropped,
+           overflows, fill, cfg->bufs);
+  }
+  fflush(stdout);
+}
+
+static int cap_set_decim(int fd, uint32_t decim)
+{
+  struct crash_reg_op op;
+  struct crash_reg_batch batch;
+
+  memset(&op, 0, sizeof(struct crash_reg_op));
+  op.bank = USRP_RX_CIC_DECIM_BASE;
+  op.op = CRASH_REG_OP_WRITE;
+  op.mask = ((1U << USRP_RX_CIC_DECIM_N) - 1) << USRP_RX_CIC_DECIM_OFFSET;
+  op.value = decim << USRP_RX_CIC_DECIM_OFFSET;
+  batch.ops = (uintptr_t)&op;
+  batch.count = 1;
+  batch.reserved = 0;
+  return ioctl(fd, CRASH_REG_BATCH, &batch);
+}
+
+// Start the S2MM ring and map it along with the status page
+static int cap_open_dev(struct cap_state *st)
+{
+  const struct cap_config *cfg = st->cfg;
+  struct crash_ring_config rc;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t slot;
+  void *p;
+
+  st->fd = open(cfg->dev, O_RDWR);
+  if (st->fd < 0) {
+    perror(cfg->dev);
+    return -1;
+  }
+  if (cfg->decim >= 0 && cap_set_decim(st->fd, cfg->decim) < 0) {
+    perror("CRASH_REG_BATCH");
+    return -1;
+  }
+
+  memset(&rc, 0, sizeof(struct crash_ring_config));
+  rc.dir = CRASH_DIR_S2MM;
+  rc.nslots = cfg->ring_slots;
+  rc.slot_size = cfg->slot_size;
+  rc.cmd_data = (cfg->slot_size << DMA_S2MM_CMD_SIZE_OFFSET) |
+                (cfg->tdest << DMA_S2MM_CMD_TDEST_OFFSET) |
+                (1U << DMA_S2MM_CMD_EN_OFFSET);
+  if (ioctl(st->fd, CRASH_RING_START, &rc) < 0) {
+    perror("CRASH_RING_START");
+    return -1;
+  }
+  // Slots are rounded up to a power of two pages
+  for (slot = page; slot < cfg->slot_size; slot <<= 1);
+  st->ring_len = page + slot * cfg->ring_slots;
+  p = mmap(NULL, st->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, MMAP_RING_S2MM);
+  if (p == MAP_FAILED) {
+    perror("mmap ring");
+    return -1;
+  }
+  st->ctrl = p;
+  p = mmap(NULL, page, PROT_READ, MAP_SHARED, st->fd, MMAP_STATUS);
+  if (p == MAP_FAILED) {
+    perror("mmap status");
+    return -1;
+  }
+  st->status = p;
+  return 0;
+}
+
+static void cap_usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s [options] -o file\n"
+    "  -d dev       device (/dev/crash)\n"
+    "  -o file      output file\n"
+    "  -s size      bytes per DMA and per write, multiple of 4k, k / M suffixes (1M)\n"
+    "  -n slots     S2MM ring slots (16)\n"
+    "  -b bufs      buffers between the reader and the writer (256)\n"
+    "  -T tdest     TDEST of the DMA commands (0)\n"
+    "  -c decim     set USRP_RX_CIC_DECIM before starting\n"
+    "  -r cpu       pin the reader thread\n"
+    "  -w cpu       pin the writer thread\n"
+    "  -B           buffered writes instead of O_DIRECT\n"
+    "  -t seconds   run time, 0 until interrupted (0)\n"
+    "  -i seconds   report interval (1)\n"
+    "  -j           JSON lines instead of text\n", prog);
+}
+
+static int cap_parse_size(const char *s, uint32_t *out)
+{
+  char *end;
+  unsigned long v = strtoul(s, &end, 0);
+
+  if (end == s) return -1;
+  if (*end == 'k' || *end == 'K') { v <<= 10; end++; }
+  else if (*end == 'M') { v <<= 20; end++; }
+  if (*end) return -1;
+  *out = v;
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct cap_config cfg;
+  struct cap_state st;
+  struct sigaction sa;
+  pthread_t reader, writer;
+  uint64_t start, now, last, stop, written, last_written, dropped;
+  uint32_t overflows0, head, tail;
+  int opt, flags, result = 0;
+
+  memset(&cfg, 0, sizeof(struct cap_config));
+  cfg.dev = "/dev/" MODULE_NAME;
+  cfg.slot_size = 1 << 20;
+  cfg.ring_slots = 16;
+  cfg.bufs = 256;
+  cfg.decim = -1;
+  cfg.reader_cpu = -1;
+  cfg.writer_cpu = -1;
+  cfg.direct = 1;
+  cfg.interval = 1.0;
+
+  while ((opt = getopt(argc, argv, "d:o:s:n:b:T:c:r:w:Bt:i:jh")) != -1) {
+    switch (opt) {
+      case 'd':
+        cfg.dev = optarg;
+        break;
+      case 'o':
+        cfg.out = optarg;
+        break;
+      case 's':
+        if (cap_parse_size(optarg, &cfg.slot_size)) goto usage;
+        break;
+      case 'n':
+        cfg.ring_slots = strtoul(optarg, NULL, 0);
+        break;
+      case 'b':
+        cfg.bufs = strtoul(optarg, NULL, 0);
+        break;
+      case 'T':
+        cfg.tdest = strtoul(optarg, NULL, 0);
+        if (cfg.tdest >= CRASH_NUM_TDEST) goto usage;
+        break;
+      case 'c':
+        cfg.decim = strtol(optarg, NULL, 0);
+        if (cfg.decim < 0 || cfg.decim >= (1 << USRP_RX_CIC_DECIM_N)) goto usage;
+        break;
+      case 'r':
+        cfg.reader_cpu = atoi(optarg);
+        break;
+      case 'w':
+        cfg.writer_cpu = atoi(optarg);
+        break;
+      case 'B':
+        cfg.direct = 0;
+        break;
+      case 't':
+        cfg.seconds = atof(optarg);
+        if (cfg.seconds < 0) goto usage;
+        break;
+      case 'i':
+        cfg.interval = atof(optarg);
+        if (cfg.interval <= 0) goto usage;
+        break;
+      case 'j':
+        cfg.json = 1;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (!cfg.out || optind != argc) goto usage;
+  if (cfg.slot_size == 0 || cfg.slot_size % CAP_ALIGN || cfg.slot_size > CRASH_MAX_BUFF_SIZE ||
+      cfg.slot_size >= (1U << DMA_S2MM_CMD_SIZE_N)) {
+    fprintf(stderr, "crash-capture: size %u out of range\n", cfg.slot_size);
+    return 1;
+  }
+  if (cfg.ring_slots == 0 || cfg.ring_slots > CRASH_RING_MAX_SLOTS || cfg.bufs == 0) goto usage;
+
+  memset(&st, 0, sizeof(struct cap_state));
+  st.cfg = &cfg;
+  st.fd = -1;
+  st.out = -1;
+  st.ring.nbufs = cfg.bufs;
+  st.ring.buf_size = cfg.slot_size;
+  if (posix_memalign((void **)&st.ring.mem, CAP_ALIGN, (size_t)cfg.bufs * cfg.slot_size)) {
+    fprintf(stderr, "crash-capture: could not allocate %u buffers\n", cfg.bufs);
+    return 1;
+  }
+  // Fault the ring in now rather than in the middle of the capture
+  memset(st.ring.mem, 0, (size_t)cfg.bufs * cfg.slot_size);
+
+  flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (cfg.direct) flags |= O_DIRECT;
+  st.out = open(cfg.out, flags, 0644);
+  if (st.out < 0) {
+    perror(cfg.out);
+    if (errno == EINVAL && cfg.direct) fprintf(stderr, "crash-capture: no O_DIRECT support, try -B\n");
+    result = 1;
+    goto out;
+  }
+  if (cap_open_dev(&st)) {
+    result = 1;
+    goto out;
+  }
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = cap_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  overflows0 = cap_rx_overflows(st.status);
+  start = last = cap_now_ns();
+  stop = cfg.seconds > 0 ? start + (uint64_t)(cfg.seconds * 1e9) : 0;
+  last_written = 0;
+  if (pthread_create(&writer, NULL, cap_writer, &st)) {
+    fprintf(stderr, "crash-capture: pthread_create failed\n");
+    result = 1;
+    goto out;
+  }
+  if (pthread_create(&reader, NULL, cap_reader, &st)) {
+    fprintf(stderr, "crash-capture: pthread_create failed\n");
+    atomic_store(&st.reader_done, 1);
+    pthread_join(writer, NULL);
+    result = 1;
+    goto out;
+  }
+
+  while (!cap_stop && !atomic_load(&st.error)) {
+    usleep(cfg.interval * 1e6 > 100000 ? 100000 : cfg.interval * 1e6);
+    now = cap_now_ns();
+    if (stop && now >= stop) cap_stop = 1;
+    if (now - last < cfg.interval * 1e9 && !cap_stop) continue;
+    written = atomic_load(&st.written);
+    head = atomic_load(&st.ring.head);
+    tail = atomic_load(&st.ring.tail);
+    cap_report(&cfg, (now - start) / 1e9, (written - last_written) / ((now - last) / 1e9) / 1e6, written,
+               atomic_load(&st.dropped), cap_rx_overflows(st.status) - overflows0, head - tail, 0);
+    last = now;
+    last_written = written;
+  }
+  cap_stop = 1;
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+
+  now = cap_now_ns();
+  written = atomic_load(&st.written);
+  dropped = atomic_load(&st.dropped);
+  cap_report(&cfg, (now - start) / 1e9, written / ((now - start) / 1e9) / 1e6, written, dropped,
+             cap_rx_overflows(st.status) - overflows0, 0, 1);
+  if (atomic_load(&st.error)) result = 1;
+
+out:
+  if (st.fd >= 0) {
+    ioctl(st.fd, CRASH_RING_STOP, CRASH_DIR_S2MM);
+    close(st.fd);
+  }
+  if (st.out >= 0) close(st.out);
+  free(st.ring.mem);
+  return result;
+
+usage:
+  cap_usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,484 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-emu.c
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  Software emulated CRASH device, for testing and
+**                benchmarking the driver without a Zynq. Registers
+**                "crash" platform devices backed by memory, with a
+**                kthread standing in for the DMA engine and a
+**                simulated interrupt.
+**
+**                insmod crash-emu.ko [instances=N] [xfer_delay_us=U]
+**                insmod crash-kmod.ko
+**
+**                The emulated DMA reads and writes memory through the
+**                direct map, so the device must not sit behind an
+**                IOMMU. MM2S data is discarded. S2MM data follows the
+**                RX mode last set through USRP_USRP_MODE_CTRL.
+**
+******************************************************************************/
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
+#include <linux/irq_sim.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+#include "crash-kmod.h"
+#include "crash-emu.h"
+
+#define CRASH_EMU_MAX_INSTANCES   8
+#define CRASH_EMU_FIFO_DEPTH      64        // Command and status FIFO depth of each direction
+#define CRASH_EMU_STS_OKAY        0x80      // DataMover status of a successful transfer
+#define CRASH_EMU_STS_DECERR      0x20      // DataMover status of an address that decodes to nothing
+
+/*
+ * One direction of the emulated DMA engine
+ */
+struct crash_emu_chan {
+  uint32_t                  cmd_addr[CRASH_EMU_FIFO_DEPTH];
+  uint32_t                  cmd_data[CRASH_EMU_FIFO_DEPTH];
+  unsigned int              cmd_head;
+  unsigned int              cmd_count;
+  uint32_t                  sts[CRASH_EMU_FIFO_DEPTH];
+  unsigned int              sts_head;
+  unsigned int              sts_count;
+  uint16_t                  xfer_cnt;       // DMA_*_XFER_CNT
+};
+
+/*
+ * Emulated device
+ */
+struct crash_emu {
+  int                       id;
+  struct page               *regs_pages;
+  uint32_t                  *regs;          // Register window
+  struct fwnode_handle      *fwnode;
+  struct irq_domain         *domain;        // Simulated interrupt controller with a single line
+  unsigned int              irq;
+  struct platform_device    *pdev;
+  struct task_struct        *thread;        // DMA engine
+  wait_queue_head_t         wait;           // Woken when the engine may have work
+  spinlock_t                lock;           // Protects the FIFOs and the status banks
+  struct crash_emu_chan     chan[CRASH_NUM_DIRS];
+  uint32_t                  rx_mode;        // RX_*_MODE
+  uint64_t                  rx_pos;         // Bytes of RX data generated so far
+};
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "Number of emulated devices");
+
+static unsigned int xfer_delay_us = 0;
+module_param(xfer_delay_us, uint, 0644);
+MODULE_PARM_DESC(xfer_delay_us, "Extra time each emulated DMA takes (us)");
+
+static struct crash_emu *crash_emus[CRASH_EMU_MAX_INSTANCES];
+
+// Quarter period of a 64 sample sine, full scale
+static const int16_t crash_emu_sine[17] = {
+  0, 3212, 6393, 9512, 12539, 15446, 18204, 20787, 23170,
+  25329, 27245, 28898, 30273, 31356, 32137, 32609, 32767
+};
+
+static int16_t crash_emu_sin(uint32_t n)
+{
+  uint32_t i = n % 16;
+
+  switch ((n / 16) % 4) {
+    case 0:  return crash_emu_sine[i];
+    case 1:  return crash_emu_sine[16 - i];
+    case 2:  return -crash_emu_sine[i];
+    default: return -crash_emu_sine[16 - i];
+  }
+}
+
+// RX sample n as the USRP interface delivers it, I in the low half word and Q in the high one
+static uint32_t crash_emu_sample(uint32_t mode, uint32_t n)
+{
+  switch (mode) {
+    case RX_TEST_SINE_MODE:
+      return (uint16_t)crash_emu_sin(n + 16) | ((uint32_t)(uint16_t)crash_emu_sin(n) << 16);
+    case RX_TEST_PATTERN_MODE:
+      // I counts up, Q counts down
+      return (n & 0xFFFF) | ((~n & 0xFFFF) << 16);
+    case RX_ALL_1s_MODE:
+      return 0xFFFFFFFF;
+    case RX_I_1s_Q_0s_MODE:
+      return 0x0000FFFF;
+    case RX_I_0s_Q_1s_MODE:
+      return 0xFFFF0000;
+    default:
+      return 0;
+  }
+}
+
+static void crash_emu_fill(struct crash_emu *e, uint8_t *buf, unsigned int len)
+{
+  uint32_t word;
+  unsigned int off, n;
+
+  while (len) {
+    word = crash_emu_sample(e->rx_mode, (uint32_t)(e->rx_pos / 4));
+    off = e->rx_pos % 4;
+    n = min(4 - off, len);
+    memcpy(buf, (uint8_t *)&word + off, n);
+    buf += n;
+    len -= n;
+    e->rx_pos += n;
+  }
+}
+
+// Move one DMA between memory and the emulated fabric. Returns the status word.
+static uint32_t crash_emu_xfer(struct crash_emu *e, int dir, uint32_t addr, uint32_t cmd_data)
+{
+  uint32_t size = (cmd_data >> DMA_S2MM_CMD_SIZE_OFFSET) & ((1 << DMA_S2MM_CMD_SIZE_N)-1);
+  uint32_t mode = crash_read_reg(e->regs, USRP_USRP_MODE_CTRL);
+  phys_addr_t pa = addr;
+  unsigned int len;
+  uint8_t *va;
+
+  if ((mode & 0xF0) == CMD_RX_MODE) e->rx_mode = mode & 0x0F;
+
+  while (size) {
+    if (!pfn_valid(PHYS_PFN(pa))) return CRASH_EMU_STS_DECERR;
+    len = min_t(uint32_t, size, PAGE_SIZE - offset_in_page(pa));
+    if (dir == CRASH_DIR_S2MM) {
+      va = kmap_local_page(pfn_to_page(PHYS_PFN(pa)));
+      crash_emu_fill(e, va + offset_in_page(pa), len);
+      kunmap_local(va);
+    }
+    pa += len;
+    size -= len;
+  }
+  return CRASH_EMU_STS_OKAY;
+}
+
+// Reflect the FIFOs in the status banks. Called with e->lock held.
+static void crash_emu_update_status(struct crash_emu *e)
+{
+  struct crash_emu_chan *mm2s = &e->chan[CRASH_DIR_MM2S];
+  struct crash_emu_chan *s2mm = &e->chan[CRASH_DIR_S2MM];
+  uint32_t *regs = e->regs;
+
+  regs[DMA_BANK8_BASE] = ((uint32_t)!mm2s->sts_count << DMA_MM2S_STS_FIFO_EMPTY_OFFSET) |
+                         ((uint32_t)!s2mm->sts_count << DMA_S2MM_STS_FIFO_EMPTY_OFFSET);
+  regs[DMA_BANK9_BASE] = ((uint32_t)!mm2s->cmd_count << DMA_MM2S_CMD_FIFO_EMPTY_OFFSET) |
+                         ((uint32_t)!s2mm->cmd_count << DMA_S2MM_CMD_FIFO_EMPTY_OFFSET);
+  regs[DMA_MM2S_STS_FIFO_BASE] = mm2s->sts_count ? mm2s->sts[mm2s->sts_head] : 0;
+  regs[DMA_S2MM_STS_FIFO_BASE] = s2mm->sts_count ? s2mm->sts[s2mm->sts_head] : 0;
+  crash_write_reg_range(regs, DMA_MM2S_XFER_CNT, mm2s->xfer_cnt);
+  crash_write_reg_range(regs, DMA_S2MM_XFER_CNT, s2mm->xfer_cnt);
+}
+
+static void crash_emu_push_cmd(struct crash_emu *e, int dir, uint32_t addr, uint32_t data)
+{
+  struct crash_emu_chan *c = &e->chan[dir];
+  unsigned int tail;
+
+  if (!((data >> DMA_S2MM_CMD_EN_OFFSET) & 1)) return;
+  if (c->cmd_count == CRASH_EMU_FIFO_DEPTH) {
+    pr_warn_ratelimited("%s-emu%d: %s command FIFO overflow\n", MODULE_NAME, e->id,
+                        dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S");
+    return;
+  }
+  tail = (c->cmd_head + c->cmd_count) % CRASH_EMU_FIFO_DEPTH;
+  c->cmd_addr[tail] = addr;
+  c->cmd_data[tail] = data;
+  c->cmd_count++;
+}
+
+// GLOBAL_RESET puts every bank back to its default
+static void crash_emu_reset(struct crash_emu *e)
+{
+  uint32_t global = e->regs[GLOBAL_BANK0_BASE];
+
+  memset(e->regs, 0, REGS_TOTAL_ADDR_SPACE);
+  e->regs[GLOBAL_BANK0_BASE] = global;
+  memset(e->chan, 0, sizeof(e->chan));
+  e->rx_mode = RX_ADC_RAW_MODE;
+}
+
+// Driver accessed a register with side effects, see struct crash_emu_platform_data
+static void crash_emu_notify(void *ctx, uint32_t bank)
+{
+  struct crash_emu *e = ctx;
+  uint32_t *regs = e->regs;
+  struct crash_emu_chan *c;
+  unsigned long flags;
+  int dir;
+
+  spin_lock_irqsave(&e->lock, flags);
+  switch (bank) {
+    case DMA_MM2S_CMD_DATA_BASE:
+      crash_emu_push_cmd(e, CRASH_DIR_MM2S, regs[DMA_MM2S_CMD_ADDR_BASE], regs[DMA_MM2S_CMD_DATA_BASE]);
+      break;
+    case DMA_S2MM_CMD_DATA_BASE:
+      crash_emu_push_cmd(e, CRASH_DIR_S2MM, regs[DMA_S2MM_CMD_ADDR_BASE], regs[DMA_S2MM_CMD_DATA_BASE]);
+      break;
+    case DMA_MM2S_STS_FIFO_BASE:
+    case DMA_S2MM_STS_FIFO_BASE:
+      c = &e->chan[(bank == DMA_S2MM_STS_FIFO_BASE) ? CRASH_DIR_S2MM : CRASH_DIR_MM2S];
+      if (c->sts_count) {
+        c->sts_head = (c->sts_head + 1) % CRASH_EMU_FIFO_DEPTH;
+        c->sts_count--;
+      }
+      break;
+    case DMA_BANK0_BASE:
+      if (crash_get_bit(regs, DMA_RESET_MM2S_CMD_FIFO)) e->chan[CRASH_DIR_MM2S].cmd_count = 0;
+      if (crash_get_bit(regs, DMA_RESET_S2MM_CMD_FIFO)) e->chan[CRASH_DIR_S2MM].cmd_count = 0;
+      if (crash_get_bit(regs, DMA_CLEAR_MM2S_XFER_CNT)) e->chan[CRASH_DIR_MM2S].xfer_cnt = 0;
+      if (crash_get_bit(regs, DMA_CLEAR_S2MM_XFER_CNT)) e->chan[CRASH_DIR_S2MM].xfer_cnt = 0;
+      if (crash_get_bit(regs, DMA_RESET_STS_FIFO)) {
+        for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+          e->chan[dir].sts_count = 0;
+        }
+      }
+      break;
+    case GLOBAL_BANK0_BASE:
+      if (crash_get_bit(regs, GLOBAL_RESET)) crash_emu_reset(e);
+      break;
+    case SPEC_SENSE_BANK1_BASE:
+      if (crash_get_bit(regs, SPEC_SENSE_CLEAR_THRESHOLD_LATCHED)) regs[SPEC_SENSE_BANK3_BASE] = 0;
+      break;
+  }
+  crash_emu_update_status(e);
+  spin_unlock_irqrestore(&e->lock, flags);
+  wake_up(&e->wait);
+}
+
+// A direction can run when it is enabled, has a command and has room for the status.
+// Called with e->lock held.
+static bool crash_emu_chan_ready(struct crash_emu *e, int dir)
+{
+  uint32_t *regs = e->regs;
+  bool en;
+
+  en = (dir == CRASH_DIR_S2MM) ? crash_get_bit(regs, DMA_S2MM_XFER_EN) : crash_get_bit(regs, DMA_MM2S_XFER_EN);
+  return en && e->chan[dir].cmd_count && e->chan[dir].sts_count < CRASH_EMU_FIFO_DEPTH;
+}
+
+static bool crash_emu_has_work(struct crash_emu *e)
+{
+  unsigned long flags;
+  bool ready;
+
+  spin_lock_irqsave(&e->lock, flags);
+  ready = crash_emu_chan_ready(e, CRASH_DIR_MM2S) || crash_emu_chan_ready(e, CRASH_DIR_S2MM);
+  spin_unlock_irqrestore(&e->lock, flags);
+  return ready;
+}
+
+// Run one command of a direction. Returns false if it had nothing to do.
+static bool crash_emu_step(struct crash_emu *e, int dir)
+{
+  struct crash_emu_chan *c = &e->chan[dir];
+  uint32_t *regs = e->regs;
+  uint32_t addr, data, status, loop;
+  unsigned long flags;
+  bool irq;
+
+  spin_lock_irqsave(&e->lock, flags);
+  if (!crash_emu_chan_ready(e, dir)) {
+    spin_unlock_irqrestore(&e->lock, flags);
+    return false;
+  }
+  addr = c->cmd_addr[c->cmd_head];
+  data = c->cmd_data[c->cmd_head];
+  c->cmd_head = (c->cmd_head + 1) % CRASH_EMU_FIFO_DEPTH;
+  c->cmd_count--;
+  crash_emu_update_status(e);
+  spin_unlock_irqrestore(&e->lock, flags);
+
+  status = crash_emu_xfer(e, dir, addr, data);
+  if (xfer_delay_us) usleep_range(xfer_delay_us, xfer_delay_us + xfer_delay_us / 4 + 1);
+
+  spin_lock_irqsave(&e->lock, flags);
+  // In loop mode the command goes back in the FIFO
+  loop = (dir == CRASH_DIR_S2MM) ? crash_read_reg(regs, DMA_S2MM_CMD_FIFO_LOOP) : crash_read_reg(regs, DMA_MM2S_CMD_FIFO_LOOP);
+  if (loop) crash_emu_push_cmd(e, dir, addr, data);
+  c->xfer_cnt++;
+  if (!crash_get_bit(regs, DMA_STS_FIFO_AUTO_READ)) {
+    c->sts[(c->sts_head + c->sts_count) % CRASH_EMU_FIFO_DEPTH] = status;
+    c->sts_count++;
+  }
+  crash_emu_update_status(e);
+  irq = (dir == CRASH_DIR_S2MM) ? crash_get_bit(regs, DMA_S2MM_INTERRUPT) : crash_get_bit(regs, DMA_MM2S_INTERRUPT);
+  spin_unlock_irqrestore(&e->lock, flags);
+
+  if (irq) irq_set_irqchip_state(e->irq, IRQCHIP_STATE_PENDING, true);
+  return true;
+}
+
+// DMA engine, alternating between the directions like the two DataMover channels would
+static int crash_emu_thread(void *data)
+{
+  struct crash_emu *e = data;
+  bool busy;
+  int dir;
+
+  while (!kthread_should_stop()) {
+    wait_event_interruptible(e->wait, crash_emu_has_work(e) || kthread_should_stop());
+    do {
+      busy = false;
+      for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+        busy |= crash_emu_step(e, dir);
+      }
+      cond_resched();
+    } while (busy && !kthread_should_stop());
+  }
+  return 0;
+}
+
+static void crash_emu_destroy(struct crash_emu *e)
+{
+  if (e->pdev) platform_device_unregister(e->pdev);
+  if (e->thread) kthread_stop(e->thread);
+  if (e->irq) irq_dispose_mapping(e->irq);
+  if (e->domain) irq_domain_remove_sim(e->domain);
+  if (e->fwnode) irq_domain_free_fwnode(e->fwnode);
+  if (e->regs_pages) __free_pages(e->regs_pages, get_order(REGS_TOTAL_ADDR_SPACE));
+  kfree(e);
+}
+
+static struct crash_emu *crash_emu_create(int id)
+{
+  struct crash_emu_platform_data pdata;
+  struct platform_device_info info;
+  struct resource res;
+  struct crash_emu *e;
+  int result;
+
+  e = kzalloc(sizeof(struct crash_emu), GFP_KERNEL);
+  if (!e) return ERR_PTR(-ENOMEM);
+  e->id = id;
+  spin_lock_init(&e->lock);
+  init_waitqueue_head(&e->wait);
+
+  // The driver hands the register window's physical address around as 32 bits
+  e->regs_pages = alloc_pages(GFP_KERNEL | GFP_DMA32 | __GFP_ZERO, get_order(REGS_TOTAL_ADDR_SPACE));
+  if (!e->regs_pages) {
+    result = -ENOMEM;
+    goto err;
+  }
+  e->regs = page_address(e->regs_pages);
+  crash_emu_update_status(e);
+
+  e->fwnode = irq_domain_alloc_named_id_fwnode("crash-emu", id);
+  if (!e->fwnode) {
+    result = -ENOMEM;
+    goto err;
+  }
+  e->domain = irq_domain_create_sim(e->fwnode, 1);
+  if (IS_ERR(e->domain)) {
+    result = PTR_ERR(e->domain);
+    e->domain = NULL;
+    goto err;
+  }
+  e->irq = irq_create_mapping(e->domain, 0);
+  if (!e->irq) {
+    result = -ENXIO;
+    goto err;
+  }
+
+  e->thread = kthread_run(crash_emu_thread, e, "crash-emu/%d", id);
+  if (IS_ERR(e->thread)) {
+    result = PTR_ERR(e->thread);
+    e->thread = NULL;
+    goto err;
+  }
+
+  memset(&pdata, 0, sizeof(struct crash_emu_platform_data));
+  pdata.regs = e->regs;
+  pdata.regs_len = REGS_TOTAL_ADDR_SPACE;
+  pdata.notify = crash_emu_notify;
+  pdata.ctx = e;
+  memset(&res, 0, sizeof(struct resource));
+  res.start = e->irq;
+  res.end = e->irq;
+  res.flags = IORESOURCE_IRQ;
+
+  memset(&info, 0, sizeof(struct platform_device_info));
+  info.name = MODULE_NAME;
+  info.id = id;
+  info.res = &res;
+  info.num_res = 1;
+  info.data = &pdata;
+  info.size_data = sizeof(struct crash_emu_platform_data);
+  info.dma_mask = DMA_BIT_MASK(32);
+  e->pdev = platform_device_register_full(&info);
+  if (IS_ERR(e->pdev)) {
+    result = PTR_ERR(e->pdev);
+    e->pdev = NULL;
+    goto err;
+  }
+  return e;
+
+err:
+  crash_emu_destroy(e);
+  return ERR_PTR(result);
+}
+
+static void crash_emu_destroy_all(void)
+{
+  int i;
+
+  for (i = CRASH_EMU_MAX_INSTANCES - 1; i >= 0; i--) {
+    if (!crash_emus[i]) continue;
+    crash_emu_destroy(crash_emus[i]);
+    crash_emus[i] = NULL;
+  }
+}
+
+static int __init crash_emu_init(void)
+{
+  struct crash_emu *e;
+  unsigned int i;
+
+  if (instances == 0 || instances > CRASH_EMU_MAX_INSTANCES) return -EINVAL;
+  for (i = 0; i < instances; i++) {
+    e = crash_emu_create(i);
+    if (IS_ERR(e)) {
+      printk(KERN_ERR "%s crash_emu_init(): Error creating emulated device %u\n", MODULE_NAME, i);
+      crash_emu_destroy_all();
+      return PTR_ERR(e);
+    }
+    crash_emus[i] = e;
+  }
+  printk(KERN_INFO "%s crash_emu_init(): Emulating %u device(s)\n", MODULE_NAME, instances);
+  return 0;
+}
+
+static void __exit crash_emu_exit(void)
+{
+  crash_emu_destroy_all();
+  printk(KERN_INFO "%s crash_emu_exit(): Removed emulated devices\n", MODULE_NAME);
+}
+
+module_init(crash_emu_init);
+module_exit(crash_emu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Software emulated CRASH device");
@@ -0,0 +1,38 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-emu.h
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  Interface between the CRASH driver and the software
+**                emulated device in crash-emu.c. Kernel only.
+**
+******************************************************************************/
+#ifndef CRASH_EMU_H
+#define CRASH_EMU_H
+
+#include <linux/types.h>
+
+// Platform data of an emulated device. Its register window is ordinary memory, so the emulator
+// cannot see bus accesses; the driver reports the ones with side effects through notify().
+struct crash_emu_platform_data {
+  uint32_t  *regs;                  // Register window, below 4 GB
+  size_t    regs_len;
+  // Called after the driver writes a bank or reads a status FIFO bank, possibly with interrupts off
+  void      (*notify)(void *ctx, uint32_t bank);
+  void      *ctx;
+};
+
+#endif
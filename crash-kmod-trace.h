@@ -0,0 +1,178 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-kmod-trace.h
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  Tracepoints for the CRASH driver. Enable them with
+**                echo 1 > /sys/kernel/tracing/events/crash/enable
+**                or perf record -e 'crash:*'. Events carry the file
+**                descriptor that queued the DMA as fd (a hashed pointer).
+**
+******************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM crash
+
+#if !defined(_CRASH_KMOD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CRASH_KMOD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A DMA went through the channel mutex, after waiting wait_ns for it
+TRACE_EVENT(crash_dma_mutex,
+  TP_PROTO(int dir, const void *fd, u64 wait_ns),
+  TP_ARGS(dir, fd, wait_ns),
+  TP_STRUCT__entry(
+    __field(int,          dir)
+    __field(const void *, fd)
+    __field(u64,          wait_ns)
+  ),
+  TP_fast_assign(
+    __entry->dir     = dir;
+    __entry->fd      = fd;
+    __entry->wait_ns = wait_ns;
+  ),
+  TP_printk("dir=%s fd=%p wait_ns=%llu",
+            __entry->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s", __entry->fd, __entry->wait_ns)
+);
+
+DECLARE_EVENT_CLASS(crash_dma_cmd_class,
+  TP_PROTO(int dir, const void *fd, uint32_t addr, uint32_t cmd_data),
+  TP_ARGS(dir, fd, addr, cmd_data),
+  TP_STRUCT__entry(
+    __field(int,          dir)
+    __field(const void *, fd)
+    __field(uint32_t,     addr)
+    __field(uint32_t,     size)
+    __field(uint32_t,     tdest)
+  ),
+  TP_fast_assign(
+    __entry->dir   = dir;
+    __entry->fd    = fd;
+    __entry->addr  = addr;
+    __entry->size  = (cmd_data >> DMA_S2MM_CMD_SIZE_OFFSET) & ((1 << DMA_S2MM_CMD_SIZE_N)-1);
+    __entry->tdest = (cmd_data >> DMA_S2MM_CMD_TDEST_OFFSET) & ((1 << DMA_S2MM_CMD_TDEST_N)-1);
+  ),
+  TP_printk("dir=%s fd=%p addr=0x%08x size=%u tdest=%u",
+            __entry->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s", __entry->fd,
+            __entry->addr, __entry->size, __entry->tdest)
+);
+
+// Command written to the DMA command FIFO
+DEFINE_EVENT(crash_dma_cmd_class, crash_dma_cmd,
+  TP_PROTO(int dir, const void *fd, uint32_t addr, uint32_t cmd_data),
+  TP_ARGS(dir, fd, addr, cmd_data)
+);
+
+// Blocking waiter woken by its completion
+DEFINE_EVENT(crash_dma_cmd_class, crash_dma_wakeup,
+  TP_PROTO(int dir, const void *fd, uint32_t addr, uint32_t cmd_data),
+  TP_ARGS(dir, fd, addr, cmd_data)
+);
+
+// DMA_*_XFER_EN changed
+TRACE_EVENT(crash_dma_xfer_en,
+  TP_PROTO(int dir, bool en),
+  TP_ARGS(dir, en),
+  TP_STRUCT__entry(
+    __field(int,  dir)
+    __field(bool, en)
+  ),
+  TP_fast_assign(
+    __entry->dir = dir;
+    __entry->en  = en;
+  ),
+  TP_printk("dir=%s en=%d", __entry->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s", __entry->en)
+);
+
+// Interrupt (or threaded poll round) with the directions that had a completion waiting
+TRACE_EVENT(crash_irq,
+  TP_PROTO(unsigned int pending),
+  TP_ARGS(pending),
+  TP_STRUCT__entry(
+    __field(unsigned int, pending)
+  ),
+  TP_fast_assign(
+    __entry->pending = pending;
+  ),
+  TP_printk("mm2s=%d s2mm=%d",
+            !!(__entry->pending & (1 << CRASH_DIR_MM2S)), !!(__entry->pending & (1 << CRASH_DIR_S2MM)))
+);
+
+// Completion consumed from the status FIFO (status is 0 in auto read mode)
+TRACE_EVENT(crash_dma_sts,
+  TP_PROTO(int dir, uint32_t status),
+  TP_ARGS(dir, status),
+  TP_STRUCT__entry(
+    __field(int,      dir)
+    __field(uint32_t, status)
+  ),
+  TP_fast_assign(
+    __entry->dir    = dir;
+    __entry->status = status;
+  ),
+  TP_printk("dir=%s status=0x%08x", __entry->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s", __entry->status)
+);
+
+// DMA finished, latency_ns is measured from when it was queued
+TRACE_EVENT(crash_dma_complete,
+  TP_PROTO(int dir, const void *fd, uint32_t cmd_data, int error, s64 latency_ns),
+  TP_ARGS(dir, fd, cmd_data, error, latency_ns),
+  TP_STRUCT__entry(
+    __field(int,          dir)
+    __field(const void *, fd)
+    __field(uint32_t,     size)
+    __field(uint32_t,     tdest)
+    __field(int,          error)
+    __field(s64,          latency_ns)
+  ),
+  TP_fast_assign(
+    __entry->dir        = dir;
+    __entry->fd         = fd;
+    __entry->size       = (cmd_data >> DMA_S2MM_CMD_SIZE_OFFSET) & ((1 << DMA_S2MM_CMD_SIZE_N)-1);
+    __entry->tdest      = (cmd_data >> DMA_S2MM_CMD_TDEST_OFFSET) & ((1 << DMA_S2MM_CMD_TDEST_N)-1);
+    __entry->error      = error;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("dir=%s fd=%p size=%u tdest=%u error=%d latency_ns=%lld",
+            __entry->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s", __entry->fd,
+            __entry->size, __entry->tdest, __entry->error, __entry->latency_ns)
+);
+
+// Step of a triggered register list applied
+TRACE_EVENT(crash_trig_run,
+  TP_PROTO(uint32_t id, uint32_t event, uint32_t step),
+  TP_ARGS(id, event, step),
+  TP_STRUCT__entry(
+    __field(uint32_t, id)
+    __field(uint32_t, event)
+    __field(uint32_t, step)
+  ),
+  TP_fast_assign(
+    __entry->id    = id;
+    __entry->event = event;
+    __entry->step  = step;
+  ),
+  TP_printk("id=%u event=%u step=%u", __entry->id, __entry->event, __entry->step)
+);
+
+#endif
+
+// Out of tree module, the Makefile adds the source directory to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE crash-kmod-trace
+#include <trace/define_trace.h>
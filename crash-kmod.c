@@ -33,6 +33,7 @@
 #include <linux/mm.h>
 #include <linux/of.h>
 #include <linux/of_address.h>
+#include <linux/of_reserved_mem.h>
 #include <linux/interrupt.h>
 #include <linux/poll.h>
 #include <linux/atomic.h>
@@ -41,9 +42,195 @@
 #include <linux/mutex.h>
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/rwsem.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/idr.h>
+#include <linux/kthread.h>
+#include <linux/uio.h>
+#include <linux/io_uring/cmd.h>
 #include <asm/page.h>
 #include <asm/ioctl.h>
 #include "crash-kmod.h"
+#include "crash-emu.h"
+
+#define CREATE_TRACE_POINTS
+#include "crash-kmod-trace.h"
+
+/*
+ * Streaming ring for one DMA direction
+ * Owned by the file descriptor that created it, active while chan->ring points to it
+ */
+struct crash_ring {
+  int                       dir;                          // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  struct crash_ring_ctrl    *ctrl;                        // Shared control page (head / tail)
+  struct page               *slots[CRASH_RING_MAX_SLOTS]; // Slot buffers
+  dma_addr_t                slot_dma[CRASH_RING_MAX_SLOTS]; // Streaming mappings of the slots
+  ktime_t                   slot_pushed[CRASH_RING_MAX_SLOTS]; // When each slot was queued
+  unsigned int              order;                        // Page order of each slot
+  uint32_t                  nslots;
+  uint32_t                  slot_size;
+  uint32_t                  cmd_data;                     // DMA_*_CMD_DATA for every slot
+  uint32_t                  flags;                        // CRASH_RING_*
+  uint32_t                  submitted;                    // Commands written to the command FIFO
+  uint32_t                  done;                         // Commands completed by the DMA
+  struct crash_private_data *pd;                          // Owning file descriptor, for tracing
+};
+
+/*
+ * Queued DMA transfer
+ * Blocking transfers live on the stack of the waiting thread, asynchronous transfers post
+ * an event to the submitting file descriptor and are freed when they complete.
+ */
+struct crash_dma_req {
+  struct list_head          list;
+  struct crash_private_data *pd;            // Event target, NULL for blocking transfers
+  struct crash_private_data *owner;         // Submitting file descriptor, for tracing
+  struct io_uring_cmd       *ioucmd;        // Completes an io_uring command instead of posting an event
+  int                       dir;
+  uint32_t                  addr;           // DMA_*_CMD_ADDR
+  uint32_t                  cmd_data;       // DMA_*_CMD_DATA
+  uint64_t                  user_data;
+  uint32_t                  status;         // DMA_*_STS_FIFO word
+  int                       error;
+  bool                      issued;         // Written to the command FIFO
+  bool                      done;
+  ktime_t                   queued;         // Submit time, for the latency histogram
+  struct crash_stamp        stamp;
+  struct crash_flow         *flow;          // Scheduler queue while pending
+};
+
+/*
+ * State of a CRASH_URING_DMA command, kept in io_uring_cmd.pdu
+ */
+struct crash_uring_pdu {
+  struct crash_dma_req      *req;           // NULL once the DMA has completed, protected by chan->lock
+  int                       dir;
+  int                       result;         // Bytes moved or negative errno
+  uint32_t                  status;         // DMA_*_STS_FIFO word
+};
+
+/*
+ * Scheduler queue of one file descriptor for one direction and TDEST
+ */
+struct crash_flow {
+  struct list_head          node;           // On chan->active[prio] while it has requests
+  struct list_head          reqs;           // Pending requests, in submission order
+  unsigned int              prio;
+  uint32_t                  quantum;        // Bytes earned per round
+  uint32_t                  deficit;        // Bytes it may still send this round
+};
+
+// Commands kept outstanding in the hardware command FIFO
+#define CRASH_DMA_INFLIGHT_MAX    CRASH_RING_MAX_SLOTS
+
+// Time an aborted channel gets to finish the command the DataMover is working on
+#define CRASH_ABORT_DRAIN_US      100
+
+/*
+ * Exclusive channel, a DMA direction fed from a submission / completion queue shared with userspace
+ * Owned by the file descriptor that created it, active while chan->lease points to it
+ */
+struct crash_lease {
+  int                       dir;
+  struct crash_lease_ctrl   *ctrl;          // Shared mapping: control page, SQ, CQ
+  struct crash_sqe          *sq;
+  struct crash_cqe          *cq;
+  size_t                    len;            // Length of the shared mapping
+  uint32_t                  entries;
+  uint32_t                  idle_us;
+  uint32_t                  sq_head;        // Driver copies of the indices it owns
+  uint32_t                  cq_tail;
+  uint32_t                  issued;         // Commands written to the command FIFO
+  uint32_t                  done;           // Commands completed by the DMA
+  uint64_t                  user_data[CRASH_DMA_INFLIGHT_MAX]; // Commands in the FIFO, by index % CRASH_DMA_INFLIGHT_MAX
+  uint32_t                  cmd_data[CRASH_DMA_INFLIGHT_MAX];
+  ktime_t                   queued[CRASH_DMA_INFLIGHT_MAX];
+  struct task_struct        *thread;        // Polls the SQ and the status FIFO
+  wait_queue_head_t         wait;           // The thread sleeps here once idle
+  struct crash_private_data *pd;
+};
+
+/*
+ * Register write of a triggered list, value already masked
+ */
+struct crash_trig_write {
+  uint32_t                  bank;
+  uint32_t                  mask;           // 0 pads a short step
+  uint32_t                  value;
+};
+
+/*
+ * Register list the driver runs on an event, see crash_trig_fire()
+ * Owned by the file descriptor that set it, active while d->trigs[id] points to it
+ */
+struct crash_trig_list {
+  struct crash_dev_drvdata  *d;
+  struct crash_private_data *pd;
+  uint32_t                  id;
+  uint32_t                  event;          // CRASH_TRIG_*
+  uint32_t                  every;          // Events per step
+  uint32_t                  flags;          // CRASH_TRIG_ONESHOT
+  uint32_t                  nsteps;
+  uint32_t                  step_len;       // Writes per step
+  uint32_t                  step;           // Next step to run
+  bool                      armed;          // Cleared when the list is removed or a one shot list is done
+  uint64_t                  events;         // Events counted so far
+  uint64_t                  seen;           // DMA lists: stats.transfers already counted
+  ktime_t                   period;
+  struct hrtimer            timer;          // CRASH_TRIG_TIMER lists
+  struct crash_trig_write   writes[];
+};
+
+// Latency histogram buckets: bucket 0 is under 1 us, bucket i covers [2^(i-1), 2^i) us and the
+// last bucket everything slower
+#define CRASH_LAT_BUCKETS         20
+
+/*
+ * Per direction statistics, updated on the completion path
+ */
+struct crash_dma_stats {
+  atomic64_t                transfers;
+  atomic64_t                bytes;
+  atomic64_t                errors;         // DMAs aborted or cancelled
+  atomic64_t                timeouts;       // Blocking DMAs that hit their deadline
+  atomic64_t                mutex_wait_ns;  // Time blocking DMAs waited for the channel semaphore
+  atomic64_t                fifo_errors;    // USRP FIFO episodes: RX overflows (S2MM), TX underflows (MM2S)
+  atomic64_t                lat_hist[CRASH_LAT_BUCKETS]; // Submit to complete latency
+};
+
+/*
+ * Per direction DMA state
+ */
+struct crash_dma_chan {
+  struct rw_semaphore       sem;            // Held shared for the duration of a blocking DMA, exclusively to reconfigure
+  wait_queue_head_t         irq_wait;       // Wait queue for blocking DMAs
+  spinlock_t                lock;           // Protects ring and request queues against the interrupt handler
+  struct list_head          active[CRASH_SCHED_PRIOS]; // Flows with requests waiting for room in the command FIFO
+  unsigned int              nactive[CRASH_SCHED_PRIOS];
+  unsigned int              pending_cnt;    // Requests waiting in all flows
+  struct list_head          inflight;       // Requests in the command FIFO, in completion order
+  unsigned int              inflight_cnt;
+  bool                      xfer_en;        // DMA_*_XFER_EN is set
+  struct crash_ring         *ring;          // Active streaming ring, if any
+  wait_queue_head_t         ring_wait;      // Woken when the ring advances
+  struct crash_lease        *lease;         // Active exclusive channel, if any
+  uint16_t                  xfer_cnt_seen;  // Last DMA_*_XFER_CNT consumed while auto reading status
+  ktime_t                   stamp;          // When the completions being retired were seen
+  uint16_t                  stamp_xfer_cnt; // DMA_*_XFER_CNT at that time
+  uint64_t                  sample_bytes[CRASH_NUM_TDEST]; // S2MM bytes per TDEST since USRP_RX_ENABLE was set
+  struct crash_dma_stats    stats;
+};
 
 /*
  * Global device data for CRASH driver
@@ -53,245 +240,3252 @@
 struct crash_dev_drvdata {
   struct platform_device  *pdev;
   struct miscdevice       mdev;
+  struct miscdevice       stream_mdev;      // read() / write() data path, see crash_stream_xfer()
+  int                     id;               // Instance number, from the "crash" alias if the devicetree has one
+  char                    name[16];         // Device node and IRQ name: crash for instance 0, crashN otherwise
+  char                    stream_name[24];  // name-stream
   uint32_t volatile       *regs;            // Pointer (kernel virtual space) to Control / Status registers
+  const struct crash_emu_platform_data *emu; // Set when the device is emulated by crash-emu
   uint32_t                regs_phys_addr;   // Control / Status registers
   size_t                  regs_len;         // Control / Status registers length
-  struct mutex            s2mm_mutex;       // Mutex for S2MM DMAs (i.e. reads)
-  struct mutex            mm2s_mutex;       // Mutex for M2SS DMAs (i.e. writes)
   unsigned int            irq;              // IRQ
-  atomic_t                irq_s2mm;         // Unacknowledged IRQ
-  atomic_t                irq_mm2s;         // Unacknowledged IRQ
-  wait_queue_head_t       irq_s2mm_wait;    // Wait queue for interrupts
-  wait_queue_head_t       irq_mm2s_wait;    // Wait queue for interrupts
+  struct crash_dma_chan   chan[CRASH_NUM_DIRS];
+  bool                    sts_auto_read;    // DMA_STS_FIFO_AUTO_READ is set, completions are counted by DMA_*_XFER_CNT
+  uint32_t                *shadow;          // Copy of the software owned banks, see crash_reg_shadowed()
+  spinlock_t              shadow_lock;      // Serializes shadow updates, taken inside the channel locks
+  atomic64_t              irqs;             // Interrupts taken
+  atomic64_t              errant_irqs;      // Interrupts that found no completion
+  struct crash_status_page *status;         // Read only status page, see crash_status_update()
+  spinlock_t              status_lock;      // Serializes status page updates
+  struct list_head        thresh_fds;       // File descriptors subscribed to threshold events
+  spinlock_t              thresh_lock;      // Protects thresh_fds, serializes threshold event producers
+  struct dentry           *debugfs;
+  struct hrtimer          monitor;          // Polls the USRP FIFO flags, see crash_status_update()
+  struct crash_trig_list  *trigs[CRASH_TRIG_MAX]; // Triggered register lists
+  unsigned int            trigs_dma;        // Lists triggered by DMA completions
+  spinlock_t              trig_lock;        // Protects trigs and serializes running them, taken outside the channel locks
+  struct crash_buff       *pool;            // Default DMA buffers reserved at probe
+  unsigned int            pool_size;
+  unsigned long           *pool_used;       // Bitmap of the pool buffers attached to a file descriptor
+  spinlock_t              pool_lock;
+};
+
+/*
+ * DMA buffer owned by a file descriptor
+ */
+struct crash_buff {
+  uint32_t                  mode;                 // CRASH_BUFF_COHERENT or CRASH_BUFF_STREAMING
+  void                      *cpu_addr;            // Kernel address of a coherent buffer
+  struct page               *pages;               // Pages of a streaming buffer
+  dma_addr_t                dma_addr;             // Bus address of DMA buffer
+  size_t                    len;                  // Length of DMA buffer
+  unsigned int              order;
+  bool                      pooled;               // Borrowed from d->pool, slot pool_idx
+  unsigned int              pool_idx;
+};
+
+/*
+ * User memory pinned for DMA
+ */
+struct crash_user_buff {
+  struct page               **pages;              // Pinned pages, NULL if the slot is free
+  unsigned int              npages;
+  struct sg_table           sgt;                  // DMA mapping, one entry per contiguous piece
+  size_t                    len;
+};
+
+/*
+ * Local data for each file descriptor
+ * Used to hold information about DMA buffer
+ */
+struct crash_private_data {
+  struct crash_dev_drvdata  *d;                   // Pointer to device data
+  struct crash_buff         buffs[CRASH_MAX_BUFFS];
+  unsigned int              nbuffs;
+  struct crash_user_buff    ubuffs[CRASH_MAX_USER_BUFFS];
+  struct rw_semaphore       buffs_sem;            // Held for reading while DMAs are being set up on the buffers
+  atomic_t                  buff_maps;            // Live mmaps of the buffers
+  struct crash_ring         *ring[CRASH_NUM_DIRS];// Streaming rings created by this file descriptor
+  struct crash_lease        *lease[CRASH_NUM_DIRS];// Exclusive channels created by this file descriptor
+  DECLARE_KFIFO_PTR(evq, struct crash_event);     // Events waiting to be read()
+  spinlock_t                evq_lock;             // Serializes event producers
+  struct mutex              evq_mutex;            // Serializes readers
+  wait_queue_head_t         evq_wait;             // Woken when an event is queued
+  unsigned int              outstanding;          // Asynchronous DMAs not yet completed, protected by evq_lock
+  DECLARE_KFIFO(thq, struct crash_event, CRASH_THRESH_QUEUE_LEN); // Threshold and FIFO events, producers hold d->thresh_lock
+  struct list_head          thresh_node;          // On d->thresh_fds while subscribed
+  bool                      thresh_sub;
+  bool                      fifo_sub;
+  uint32_t                  thq_lost;             // Threshold events dropped since the last one queued
+  struct crash_flow         flows[CRASH_NUM_DIRS][CRASH_NUM_TDEST]; // Scheduler queues, protected by chan->lock
+  struct crash_sched        sched;                // Priority and weight of new flows
+  struct crash_poll_policy  poll;                 // How blocking DMAs wait
+  struct crash_ring_config  stream_cfg[CRASH_NUM_DIRS]; // Rings started by read() / write() on the stream node
+  uint32_t                  stream_off[CRASH_NUM_DIRS]; // Bytes read / written of the current slot
+  struct mutex              stream_mutex[CRASH_NUM_DIRS]; // Serializes readers / writers
+};
+
+static unsigned int pool_buffs = 4;
+module_param(pool_buffs, uint, 0444);
+MODULE_PARM_DESC(pool_buffs, "Default DMA buffers reserved per device at probe, from CMA or the memory-region node");
+
+static unsigned int poll_spin_max_bytes = 65536;
+module_param(poll_spin_max_bytes, uint, 0644);
+MODULE_PARM_DESC(poll_spin_max_bytes, "Largest blocking DMA that spins before sleeping (bytes)");
+
+static unsigned int poll_spin_us = 20;
+module_param(poll_spin_us, uint, 0644);
+MODULE_PARM_DESC(poll_spin_us, "Time a blocking DMA spins on the status register (us)");
+
+static unsigned int poll_spin_max_us = 1000;
+module_param(poll_spin_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_spin_max_us, "Largest spin budget a file descriptor or blocking DMA may ask for (us)");
+
+static unsigned int poll_sleep_min_us = 50;
+module_param(poll_sleep_min_us, uint, 0644);
+MODULE_PARM_DESC(poll_sleep_min_us, "Minimum sleep between status polls with interrupts disabled (us)");
+
+static unsigned int poll_sleep_max_us = 200;
+module_param(poll_sleep_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_sleep_max_us, "Maximum sleep between status polls with interrupts disabled (us)");
+
+static unsigned int stream_slots = 4;
+module_param(stream_slots, uint, 0644);
+MODULE_PARM_DESC(stream_slots, "Slots of the rings behind read() / write() on the stream node");
+
+static unsigned int stream_slot_size = 65536;
+module_param(stream_slot_size, uint, 0644);
+MODULE_PARM_DESC(stream_slot_size, "Bytes per slot of the rings behind read() / write() on the stream node");
+
+static unsigned int monitor_us = 1000;
+module_param(monitor_us, uint, 0444);
+MODULE_PARM_DESC(monitor_us, "Period of the USRP FIFO overflow / underflow check, 0 to only check on interrupts (us)");
+
+static bool irq_threaded;
+module_param(irq_threaded, bool, 0444);
+MODULE_PARM_DESC(irq_threaded, "Service DMAs from an interrupt thread that polls while traffic is heavy");
+
+static unsigned int irq_poll_us = 50;
+module_param(irq_poll_us, uint, 0644);
+MODULE_PARM_DESC(irq_poll_us, "Interrupt thread: time between polls while the interrupt is masked (us)");
+
+static unsigned int irq_poll_budget = 64;
+module_param(irq_poll_budget, uint, 0644);
+MODULE_PARM_DESC(irq_poll_budget, "Interrupt thread: polls before the interrupt is unmasked again");
+
+// Instance numbers in use
+static DEFINE_IDA(crash_ida);
+
+static const struct of_device_id crash_of_ids[] = {
+  { .compatible = "crash" },
+  { }
+};
+
+// An emulated device only sees register accesses with side effects if we tell it about them
+static inline void crash_emu_notify(struct crash_dev_drvdata *d, uint32_t bank)
+{
+  if (unlikely(d->emu)) d->emu->notify(d->emu->ctx, bank);
+}
+
+// Read only status bits that live in a shadowed bank. They are kept out of the shadow so a stale
+// copy is never written back to the hardware.
+static inline uint32_t crash_shadow_ro_mask(uint32_t bank)
+{
+  if (bank == DMA_BANK0_BASE) return crash_reg_mask(DMA_MM2S_XFER_IN_PROGRESS) | crash_reg_mask(DMA_S2MM_XFER_IN_PROGRESS);
+  return 0;
+}
+
+/*
+ * Shadowed register writes. Software owned banks are updated from the shadow and written through,
+ * so setting or clearing a field never reads the bank over the bus.
+ */
+static void crash_shadow_write(struct crash_dev_drvdata *d, uint32_t bank, uint32_t mask, uint32_t val)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&d->shadow_lock, flags);
+  d->shadow[bank] = ((d->shadow[bank] & ~mask) | (val & mask)) & ~crash_shadow_ro_mask(bank);
+  d->regs[bank] = d->shadow[bank];
+  crash_emu_notify(d, bank);
+  spin_unlock_irqrestore(&d->shadow_lock, flags);
+}
+
+#define crash_shadow_write_reg(d,name,val)  crash_shadow_write(d, name##_BASE, crash_reg_mask(name), (uint32_t)(val) << name##_OFFSET)
+#define crash_shadow_set_bit(d,name)        crash_shadow_write(d, name##_BASE, 1 << name##_OFFSET, 1 << name##_OFFSET)
+#define crash_shadow_clear_bit(d,name)      crash_shadow_write(d, name##_BASE, 1 << name##_OFFSET, 0)
+#define crash_shadow_get_bit(d,name)        crash_get_bit_shadow((d)->shadow, name)
+
+// Reload the shadow from the hardware, at probe and after a reset
+static void crash_shadow_load(struct crash_dev_drvdata *d)
+{
+  unsigned long flags;
+  uint32_t bank;
+
+  spin_lock_irqsave(&d->shadow_lock, flags);
+  for (bank = 0; bank < d->regs_len / sizeof(uint32_t); bank++) {
+    if (crash_reg_shadowed(bank)) d->shadow[bank] = d->regs[bank] & ~crash_shadow_ro_mask(bank);
+  }
+  spin_unlock_irqrestore(&d->shadow_lock, flags);
+}
+
+/*
+ * Helpers so code shared by both directions does not need to spell out the register names
+ */
+static inline void crash_dma_push_cmd(struct crash_dev_drvdata *d, int dir, uint32_t addr, uint32_t data)
+{
+  volatile uint32_t *regs = d->regs;
+
+  if (dir == CRASH_DIR_S2MM) {
+    crash_write_reg(regs, DMA_S2MM_CMD_ADDR, addr);
+    crash_write_reg(regs, DMA_S2MM_CMD_DATA, data);
+    crash_emu_notify(d, DMA_S2MM_CMD_DATA_BASE);
+  } else {
+    crash_write_reg(regs, DMA_MM2S_CMD_ADDR, addr);
+    crash_write_reg(regs, DMA_MM2S_CMD_DATA, data);
+    crash_emu_notify(d, DMA_MM2S_CMD_DATA_BASE);
+  }
+}
+
+static inline void crash_dma_xfer_en(struct crash_dev_drvdata *d, int dir, bool en)
+{
+  trace_crash_dma_xfer_en(dir, en);
+  if (dir == CRASH_DIR_S2MM) {
+    if (en) crash_shadow_set_bit(d, DMA_S2MM_XFER_EN);
+    else    crash_shadow_clear_bit(d, DMA_S2MM_XFER_EN);
+  } else {
+    if (en) crash_shadow_set_bit(d, DMA_MM2S_XFER_EN);
+    else    crash_shadow_clear_bit(d, DMA_MM2S_XFER_EN);
+  }
+}
+
+static inline void crash_dma_reset_cmd_fifo(struct crash_dev_drvdata *d, int dir)
+{
+  if (dir == CRASH_DIR_S2MM) {
+    crash_shadow_set_bit(d, DMA_RESET_S2MM_CMD_FIFO);
+    crash_shadow_clear_bit(d, DMA_RESET_S2MM_CMD_FIFO);
+  } else {
+    crash_shadow_set_bit(d, DMA_RESET_MM2S_CMD_FIFO);
+    crash_shadow_clear_bit(d, DMA_RESET_MM2S_CMD_FIFO);
+  }
+}
+
+static inline bool crash_dma_irq_enabled(struct crash_dev_drvdata *d, int dir)
+{
+  if (dir == CRASH_DIR_S2MM) return crash_shadow_get_bit(d, DMA_S2MM_INTERRUPT);
+  return crash_shadow_get_bit(d, DMA_MM2S_INTERRUPT);
+}
+
+static inline uint16_t crash_dma_xfer_cnt(struct crash_dev_drvdata *d, int dir)
+{
+  volatile uint32_t *regs = d->regs;
+
+  if (dir == CRASH_DIR_S2MM) return crash_read_reg(regs, DMA_S2MM_XFER_CNT);
+  return crash_read_reg(regs, DMA_MM2S_XFER_CNT);
+}
+
+// Check if a DMA has completed. With DMA_STS_FIFO_AUTO_READ the hardware drains the status FIFO
+// itself, so completions are tracked with the transfer counter instead of the FIFO empty flag.
+static inline bool crash_dma_sts_ready(struct crash_dev_drvdata *d, int dir)
+{
+  volatile uint32_t *regs = d->regs;
+
+  if (d->sts_auto_read) return crash_dma_xfer_cnt(d, dir) != d->chan[dir].xfer_cnt_seen;
+  if (dir == CRASH_DIR_S2MM) return !crash_get_bit(regs, DMA_S2MM_STS_FIFO_EMPTY);
+  return !crash_get_bit(regs, DMA_MM2S_STS_FIFO_EMPTY);
+}
+
+// Directions with a completion waiting, as a mask of (1 << dir). The status FIFO empty flags of
+// both directions share a bank, so this is a single read outside of auto read mode.
+static inline unsigned int crash_dma_sts_pending(struct crash_dev_drvdata *d)
+{
+  volatile uint32_t *regs = d->regs;
+  unsigned int pending = 0;
+  uint32_t bank;
+  int dir;
+
+  if (d->sts_auto_read) {
+    for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+      if (crash_dma_xfer_cnt(d, dir) != d->chan[dir].xfer_cnt_seen) pending |= 1 << dir;
+    }
+    return pending;
+  }
+  bank = regs[DMA_BANK8_BASE];
+  if (!((bank >> DMA_MM2S_STS_FIFO_EMPTY_OFFSET) & 1)) pending |= 1 << CRASH_DIR_MM2S;
+  if (!((bank >> DMA_S2MM_STS_FIFO_EMPTY_OFFSET) & 1)) pending |= 1 << CRASH_DIR_S2MM;
+  return pending;
+}
+
+// Consume one completion
+static inline uint32_t crash_dma_sts_pop(struct crash_dev_drvdata *d, int dir)
+{
+  volatile uint32_t *regs = d->regs;
+  uint32_t status;
+
+  if (d->sts_auto_read) {
+    d->chan[dir].xfer_cnt_seen++;
+    status = 0;
+  } else if (dir == CRASH_DIR_S2MM) {
+    // Read on status register, which causes it to read the FIFO (and therefore return the FIFO to the empty state)
+    status = crash_read_reg(regs, DMA_S2MM_STS_FIFO);
+    crash_emu_notify(d, DMA_S2MM_STS_FIFO_BASE);
+  } else {
+    status = crash_read_reg(regs, DMA_MM2S_STS_FIFO);
+    crash_emu_notify(d, DMA_MM2S_STS_FIFO_BASE);
+  }
+  trace_crash_dma_sts(dir, status);
+  return status;
+}
+
+// Switch between reading the status FIFO and auto read mode. Both channel locks must be held and
+// neither channel may have a DMA outstanding, otherwise its completion could be lost.
+static void crash_dma_set_sts_auto_read(struct crash_dev_drvdata *d, bool en)
+{
+  int dir;
+
+  if (en) {
+    crash_shadow_set_bit(d, DMA_STS_FIFO_AUTO_READ);
+  } else {
+    crash_shadow_clear_bit(d, DMA_STS_FIFO_AUTO_READ);
+    // Drop status words that were pushed before auto read was turned off
+    crash_shadow_set_bit(d, DMA_RESET_STS_FIFO);
+    crash_shadow_clear_bit(d, DMA_RESET_STS_FIFO);
+  }
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    d->chan[dir].xfer_cnt_seen = crash_dma_xfer_cnt(d, dir);
+  }
+  d->sts_auto_read = en;
+}
+
+static inline uint32_t crash_cmd_size(uint32_t cmd_data)
+{
+  return (cmd_data >> DMA_S2MM_CMD_SIZE_OFFSET) & ((1 << DMA_S2MM_CMD_SIZE_N)-1);
+}
+
+static inline uint32_t crash_cmd_tdest(uint32_t cmd_data)
+{
+  return (cmd_data >> DMA_S2MM_CMD_TDEST_OFFSET) & ((1 << DMA_S2MM_CMD_TDEST_N)-1);
+}
+
+// Time and transfer count of a service pass, taken before its first completion is retired.
+// Called with chan->lock held.
+static inline void crash_chan_stamp(struct crash_dev_drvdata *d, int dir)
+{
+  d->chan[dir].stamp = ktime_get();
+  d->chan[dir].stamp_xfer_cnt = crash_dma_xfer_cnt(d, dir);
+}
+
+// ADC samples per RX sample, from the shadowed USRP configuration
+static uint32_t crash_rx_decim(struct crash_dev_drvdata *d)
+{
+  uint32_t decim = 1;
+
+  if (!crash_read_reg_shadow(d->shadow, USRP_RX_CIC_BYPASS)) decim = max_t(uint32_t, crash_read_reg_shadow(d->shadow, USRP_RX_CIC_DECIM), 1);
+  if (!crash_read_reg_shadow(d->shadow, USRP_RX_HB_BYPASS)) decim *= 2;
+  return decim;
+}
+
+// Stamp a DMA that completed in the current service pass. S2MM completions retire in order, so
+// the bytes before this one give the sample index of its first sample. Called with chan->lock held.
+static void crash_stamp(struct crash_dev_drvdata *d, int dir, uint32_t cmd_data, struct crash_stamp *st)
+{
+  struct crash_dma_chan *chan = &d->chan[dir];
+  uint32_t tdest = crash_cmd_tdest(cmd_data);
+  uint32_t sample_size = crash_read_reg_shadow(d->shadow, USRP_RX_FIX2FLOAT_BYPASS) ? 4 : 8;
+
+  st->timestamp_ns = ktime_to_ns(chan->stamp);
+  st->xfer_cnt = chan->stamp_xfer_cnt;
+  st->sample_index = 0;
+  st->reserved = 0;
+  if (dir != CRASH_DIR_S2MM) return;
+  st->sample_index = div_u64(chan->sample_bytes[tdest], sample_size) * crash_rx_decim(d);
+  chan->sample_bytes[tdest] += crash_cmd_size(cmd_data);
+}
+
+static inline bool crash_chan_idle(struct crash_dma_chan *chan)
+{
+  return !chan->ring && !chan->lease && !chan->pending_cnt && list_empty(&chan->inflight);
+}
+
+// Lock both channels, e.g. to change configuration shared by both directions
+static inline void crash_chans_lock(struct crash_dev_drvdata *d, unsigned long *flags)
+{
+  spin_lock_irqsave(&d->chan[CRASH_DIR_MM2S].lock, *flags);
+  spin_lock_nested(&d->chan[CRASH_DIR_S2MM].lock, SINGLE_DEPTH_NESTING);
+}
+
+static inline void crash_chans_unlock(struct crash_dev_drvdata *d, unsigned long flags)
+{
+  spin_unlock(&d->chan[CRASH_DIR_S2MM].lock);
+  spin_unlock_irqrestore(&d->chan[CRASH_DIR_MM2S].lock, flags);
+}
+
+// Grab both channel semaphores so we do not change configuration in the middle of a blocking DMA
+static int crash_mutexes_lock(struct crash_dev_drvdata *d)
+{
+  if (down_write_killable(&d->chan[CRASH_DIR_MM2S].sem)) return -EINTR;
+  if (down_write_killable(&d->chan[CRASH_DIR_S2MM].sem)) {
+    up_write(&d->chan[CRASH_DIR_MM2S].sem);
+    return -EINTR;
+  }
+  return 0;
+}
+
+static void crash_mutexes_unlock(struct crash_dev_drvdata *d)
+{
+  up_write(&d->chan[CRASH_DIR_MM2S].sem);
+  up_write(&d->chan[CRASH_DIR_S2MM].sem);
+}
+
+/*
+ * Register writes on behalf of userspace: CRASH_REG_BATCH and triggered lists
+ */
+struct crash_reg_cache {
+  uint32_t bank;
+  uint32_t value;
+  bool dirty;
 };
 
+// Called with the channel locks and shadow_lock held
+static void crash_reg_flush(struct crash_dev_drvdata *d, struct crash_reg_cache *c)
+{
+  if (!c->dirty) return;
+  // Sample indices count from when RX was enabled
+  if (c->bank == (USRP_RX_ENABLE_BASE) && !crash_read_reg_shadow(d->shadow, USRP_RX_ENABLE) &&
+      ((c->value >> USRP_RX_ENABLE_OFFSET) & 1)) {
+    memset(d->chan[CRASH_DIR_S2MM].sample_bytes, 0, sizeof(d->chan[CRASH_DIR_S2MM].sample_bytes));
+  }
+  c->value &= ~crash_shadow_ro_mask(c->bank);
+  if (crash_reg_shadowed(c->bank)) d->shadow[c->bank] = c->value;
+  d->regs[c->bank] = c->value;
+  crash_emu_notify(d, c->bank);
+  c->dirty = false;
+}
+
+// Apply the next step of a list. Called with trig_lock held.
+static void crash_trig_run(struct crash_dev_drvdata *d, struct crash_trig_list *l)
+{
+  struct crash_trig_write *w = &l->writes[l->step * l->step_len];
+  struct crash_reg_cache c;
+  unsigned long flags;
+  unsigned int i;
+
+  trace_crash_trig_run(l->id, l->event, l->step);
+  crash_chans_lock(d, &flags);
+  spin_lock(&d->shadow_lock);
+  for (i = 0; i < l->step_len; i++, w++) {
+    if (!w->mask) continue;
+    c.bank = w->bank;
+    if (crash_reg_shadowed(c.bank)) {
+      c.value = d->shadow[c.bank];
+    } else {
+      c.value = (w->mask == 0xFFFFFFFF) ? 0 : d->regs[c.bank];
+    }
+    c.value = (c.value & ~w->mask) | w->value;
+    c.dirty = true;
+    crash_reg_flush(d, &c);
+  }
+  spin_unlock(&d->shadow_lock);
+  crash_chans_unlock(d, flags);
+
+  if (++l->step == l->nsteps) {
+    l->step = 0;
+    if (l->flags & CRASH_TRIG_ONESHOT) l->armed = false;
+  }
+}
+
+// Count n events of a list and run a step for every l->every of them. Called with trig_lock held.
+static void crash_trig_fire(struct crash_dev_drvdata *d, struct crash_trig_list *l, uint64_t n)
+{
+  uint64_t runs;
+  uint32_t skip;
+
+  if (!l->armed || !n) return;
+  runs = div_u64(l->events + n, l->every) - div_u64(l->events, l->every);
+  l->events += n;
+  // Writes only set fields, so one pass over the steps ending at the right one leaves the
+  // registers as running every step would
+  if (runs > l->nsteps && !(l->flags & CRASH_TRIG_ONESHOT)) {
+    div_u64_rem(runs - l->nsteps, l->nsteps, &skip);
+    l->step = (l->step + skip) % l->nsteps;
+    runs = l->nsteps;
+  }
+  while (runs-- && l->armed) crash_trig_run(d, l);
+}
+
+// Run the lists triggered by DMA completions for those retired since they last looked
+static void crash_trigs_dma(struct crash_dev_drvdata *d)
+{
+  struct crash_trig_list *l;
+  unsigned long flags;
+  uint64_t done;
+  int id;
+
+  if (!READ_ONCE(d->trigs_dma)) return;
+  spin_lock_irqsave(&d->trig_lock, flags);
+  for (id = 0; id < CRASH_TRIG_MAX; id++) {
+    l = d->trigs[id];
+    if (!l || l->event > CRASH_TRIG_DMA_S2MM) continue;
+    done = atomic64_read(&d->chan[l->event].stats.transfers);
+    // The counter starts over when the stats are reset
+    if (done < l->seen) l->seen = 0;
+    crash_trig_fire(d, l, done - l->seen);
+    l->seen = done;
+  }
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+}
+
+// Run the lists triggered by event, e.g. CRASH_TRIG_THRESHOLD
+static void crash_trigs_event(struct crash_dev_drvdata *d, uint32_t event)
+{
+  unsigned long flags;
+  int id;
+
+  spin_lock_irqsave(&d->trig_lock, flags);
+  for (id = 0; id < CRASH_TRIG_MAX; id++) {
+    if (d->trigs[id] && d->trigs[id]->event == event) crash_trig_fire(d, d->trigs[id], 1);
+  }
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+}
+
+static enum hrtimer_restart crash_trig_timer(struct hrtimer *t)
+{
+  struct crash_trig_list *l = container_of(t, struct crash_trig_list, timer);
+  struct crash_dev_drvdata *d = l->d;
+  enum hrtimer_restart restart;
+  unsigned long flags;
+
+  spin_lock_irqsave(&d->trig_lock, flags);
+  // Ticks missed while the CPU was busy still count, so the schedule keeps its phase
+  crash_trig_fire(d, l, hrtimer_forward_now(t, l->period));
+  restart = l->armed ? HRTIMER_RESTART : HRTIMER_NORESTART;
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+  return restart;
+}
+
+// Take list id off the device. Called with trig_lock held, free the list with crash_trig_free()
+// once the lock is dropped.
+static struct crash_trig_list *crash_trig_detach(struct crash_dev_drvdata *d, uint32_t id)
+{
+  struct crash_trig_list *l = d->trigs[id];
+
+  if (!l) return NULL;
+  d->trigs[id] = NULL;
+  l->armed = false;
+  if (l->event <= CRASH_TRIG_DMA_S2MM) WRITE_ONCE(d->trigs_dma, d->trigs_dma - 1);
+  return l;
+}
+
+static void crash_trig_free(struct crash_trig_list *l)
+{
+  if (l->event == CRASH_TRIG_TIMER) hrtimer_cancel(&l->timer);
+  kfree(l);
+}
+
+// Remove the lists of a file descriptor, or every list if pd is NULL
+static void crash_trigs_remove(struct crash_dev_drvdata *d, struct crash_private_data *pd)
+{
+  struct crash_trig_list *gone[CRASH_TRIG_MAX];
+  unsigned long flags;
+  unsigned int n = 0;
+  int id;
+
+  spin_lock_irqsave(&d->trig_lock, flags);
+  for (id = 0; id < CRASH_TRIG_MAX; id++) {
+    if (d->trigs[id] && (!pd || d->trigs[id]->pd == pd)) gone[n++] = crash_trig_detach(d, id);
+  }
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+  while (n) crash_trig_free(gone[--n]);
+}
+
+/*
+ * DMA scheduler. Called with chan->lock held.
+ */
+static void crash_sched_enqueue(struct crash_dma_chan *chan, struct crash_dma_req *req)
+{
+  struct crash_private_data *pd = req->owner;
+  struct crash_flow *flow = &pd->flows[req->dir][crash_cmd_tdest(req->cmd_data)];
+
+  if (list_empty(&flow->reqs)) {
+    flow->prio = pd->sched.prio;
+    flow->quantum = pd->sched.weight * CRASH_SCHED_QUANTUM;
+    flow->deficit = 0;
+    list_add_tail(&flow->node, &chan->active[flow->prio]);
+    chan->nactive[flow->prio]++;
+  }
+  list_add_tail(&req->list, &flow->reqs);
+  req->flow = flow;
+  chan->pending_cnt++;
+}
+
+// Take a request off its flow, which leaves the round once it has nothing left to send
+static void crash_sched_dequeue(struct crash_dma_chan *chan, struct crash_dma_req *req)
+{
+  struct crash_flow *flow = req->flow;
+
+  list_del(&req->list);
+  req->flow = NULL;
+  chan->pending_cnt--;
+  if (list_empty(&flow->reqs)) {
+    list_del_init(&flow->node);
+    chan->nactive[flow->prio]--;
+  }
+}
+
+// Deficit round robin over the flows of one priority. The flow at the head sends while its
+// deficit covers its next request, otherwise it earns its quantum and moves to the back.
+static struct crash_dma_req *crash_sched_pick(struct crash_dma_chan *chan, unsigned int prio)
+{
+  struct list_head *level = &chan->active[prio];
+  struct crash_flow *flow;
+  struct crash_dma_req *req;
+  uint32_t size, rounds, skip;
+  unsigned int i;
+
+  for (;;) {
+    for (i = 0; i < chan->nactive[prio]; i++) {
+      flow = list_first_entry(level, struct crash_flow, node);
+      req = list_first_entry(&flow->reqs, struct crash_dma_req, list);
+      size = crash_cmd_size(req->cmd_data);
+      if (flow->deficit >= size) {
+        flow->deficit -= size;
+        return req;
+      }
+      flow->deficit += flow->quantum;
+      list_move_tail(&flow->node, level);
+    }
+    // Nobody could send in a whole round. Credit the rounds until the first flow can at once
+    // instead of going around for every quantum of a large DMA.
+    skip = U32_MAX;
+    list_for_each_entry(flow, level, node) {
+      req = list_first_entry(&flow->reqs, struct crash_dma_req, list);
+      size = crash_cmd_size(req->cmd_data);
+      rounds = (flow->deficit >= size) ? 0 : (size - flow->deficit) / flow->quantum;
+      skip = min(skip, rounds);
+    }
+    list_for_each_entry(flow, level, node) {
+      flow->deficit += skip * flow->quantum;
+    }
+  }
+}
+
+// Next request for the command FIFO, NULL if none are waiting
+static struct crash_dma_req *crash_sched_next(struct crash_dma_chan *chan)
+{
+  struct crash_dma_req *req;
+  unsigned int prio;
+
+  for (prio = 0; prio < CRASH_SCHED_PRIOS; prio++) {
+    if (!chan->nactive[prio]) continue;
+    req = crash_sched_pick(chan, prio);
+    crash_sched_dequeue(chan, req);
+    return req;
+  }
+  return NULL;
+}
+
+// Account a finished transfer's bytes, latency and error in the direction's crash_dma_stats
+static void crash_stats_complete(struct crash_dma_stats *st, uint32_t bytes, ktime_t queued, int error)
+{
+  s64 us;
+  unsigned int bucket;
+
+  if (error) {
+    atomic64_inc(&st->errors);
+    return;
+  }
+  atomic64_inc(&st->transfers);
+  atomic64_add(bytes, &st->bytes);
+  us = ktime_us_delta(ktime_get(), queued);
+  bucket = (us > 0) ? min_t(unsigned int, fls64(us), CRASH_LAT_BUCKETS - 1) : 0;
+  atomic64_inc(&st->lat_hist[bucket]);
+}
+
+static inline struct crash_uring_pdu *crash_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+  return (struct crash_uring_pdu *)ioucmd->pdu;
+}
+
+// Post the CQE of a CRASH_URING_DMA, in the context of the task that submitted it
+static void crash_uring_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+  struct crash_uring_pdu *pdu = crash_uring_pdu(ioucmd);
+
+  io_uring_cmd_done(ioucmd, pdu->result, pdu->status, issue_flags);
+}
+
+// Hand a finished request back to its owner. Called with chan->lock held.
+static void crash_dma_req_complete(struct crash_dev_drvdata *d, struct crash_dma_req *req, uint32_t status, int error)
+{
+  struct crash_private_data *pd = req->pd;
+  struct crash_uring_pdu *pdu;
+  struct crash_event ev;
+  unsigned long flags;
+
+  trace_crash_dma_complete(req->dir, req->owner, req->cmd_data, error, ktime_to_ns(ktime_sub(ktime_get(), req->queued)));
+  crash_stats_complete(&d->chan[req->dir].stats, crash_cmd_size(req->cmd_data), req->queued, error);
+  req->status = status;
+  req->error = error;
+  if (!error) crash_stamp(d, req->dir, req->cmd_data, &req->stamp);
+  if (!pd) {
+    // Blocking transfer, the waiter owns the request
+    trace_crash_dma_wakeup(req->dir, req->owner, req->addr, req->cmd_data);
+    WRITE_ONCE(req->done, true);
+    wake_up_interruptible(&d->chan[req->dir].irq_wait);
+    return;
+  }
+
+  if (req->ioucmd) {
+    // io_uring posts the CQE from task context, safe to request from the interrupt handler
+    pdu = crash_uring_pdu(req->ioucmd);
+    pdu->req = NULL;
+    pdu->result = error ? error : crash_cmd_size(req->cmd_data);
+    pdu->status = status;
+    io_uring_cmd_complete_in_task(req->ioucmd, crash_uring_done);
+    spin_lock_irqsave(&pd->evq_lock, flags);
+    pd->outstanding--;
+    spin_unlock_irqrestore(&pd->evq_lock, flags);
+    kfree(req);
+    return;
+  }
+
+  memset(&ev, 0, sizeof(struct crash_event));
+  ev.type = CRASH_EVENT_DMA;
+  ev.error = error;
+  ev.user_data = req->user_data;
+  ev.u.dma.dir = req->dir;
+  ev.u.dma.status = status;
+  ev.u.dma.bytes = error ? 0 : crash_cmd_size(req->cmd_data);
+  ev.u.dma.tdest = crash_cmd_tdest(req->cmd_data);
+  ev.u.dma.stamp = req->stamp;
+  // Room for the event was reserved when the request was submitted
+  spin_lock_irqsave(&pd->evq_lock, flags);
+  kfifo_put(&pd->evq, ev);
+  pd->outstanding--;
+  spin_unlock_irqrestore(&pd->evq_lock, flags);
+  wake_up_interruptible(&pd->evq_wait);
+  kfree(req);
+}
+
+// Retire completed requests and feed pending ones to the command FIFO.
+// Called with chan->lock held. Returns the number of requests that completed.
+static unsigned int crash_chan_service(struct crash_dev_drvdata *d, int dir)
+{
+  struct crash_dma_chan *chan = &d->chan[dir];
+  struct crash_dma_req *req;
+  unsigned int completed = 0;
+  uint32_t status;
+
+  while (!list_empty(&chan->inflight) && crash_dma_sts_ready(d, dir)) {
+    req = list_first_entry(&chan->inflight, struct crash_dma_req, list);
+    list_del(&req->list);
+    chan->inflight_cnt--;
+    if (!completed) crash_chan_stamp(d, dir);
+    status = crash_dma_sts_pop(d, dir);
+    crash_dma_req_complete(d, req, status, 0);
+    completed++;
+  }
+
+  while (chan->pending_cnt && chan->inflight_cnt < CRASH_DMA_INFLIGHT_MAX) {
+    req = crash_sched_next(chan);
+    list_add_tail(&req->list, &chan->inflight);
+    chan->inflight_cnt++;
+    req->issued = true;
+    trace_crash_dma_cmd(dir, req->owner, req->addr, req->cmd_data);
+    crash_dma_push_cmd(d, dir, req->addr, req->cmd_data);
+  }
+
+  // Keep the DMA enabled only while it has work
+  if (!chan->xfer_en && chan->inflight_cnt) {
+    crash_dma_xfer_en(d, dir, true);
+    chan->xfer_en = true;
+  } else if (chan->xfer_en && !chan->inflight_cnt) {
+    crash_dma_xfer_en(d, dir, false);
+    chan->xfer_en = false;
+  }
+  return completed;
+}
+
+// Stop a channel that is not responding and fail everything in the command FIFO. The request
+// that timed out gets error, the others were only queued behind it and get -ECANCELED. Called with
+// both channel locks held, as the status FIFO reset is shared by the two directions.
+static void crash_chan_abort(struct crash_dev_drvdata *d, int dir, struct crash_dma_req *stuck, int error)
+{
+  volatile uint32_t *regs = d->regs;
+  struct crash_dma_chan *chan = &d->chan[dir];
+  struct crash_dma_req *req, *tmp;
+  unsigned int us;
+  bool busy;
+
+  crash_dma_xfer_en(d, dir, false);
+  chan->xfer_en = false;
+  crash_dma_reset_cmd_fifo(d, dir);
+
+  // Let the DataMover finish the command it is working on, otherwise its completion would
+  // retire the next request before that request's data has moved
+  for (us = 0; us < CRASH_ABORT_DRAIN_US; us++) {
+    busy = (dir == CRASH_DIR_S2MM) ? crash_get_bit(regs, DMA_S2MM_XFER_IN_PROGRESS)
+                                   : crash_get_bit(regs, DMA_MM2S_XFER_IN_PROGRESS);
+    if (!busy) break;
+    udelay(1);
+  }
+  if (busy) dev_err(&d->pdev->dev, "crash_chan_abort(): %s DMA still busy after reset\n", dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S");
+
+  // Resync completion tracking. Retire what the other direction has finished first, so the
+  // shared status FIFO reset cannot drop it. If it still has DMAs running, drain only ours.
+  if (!d->chan[!dir].ring && !d->chan[!dir].lease) crash_chan_service(d, !dir);
+  if (!d->sts_auto_read) {
+    if (list_empty(&d->chan[!dir].inflight)) {
+      crash_shadow_set_bit(d, DMA_RESET_STS_FIFO);
+      crash_shadow_clear_bit(d, DMA_RESET_STS_FIFO);
+    } else {
+      while (crash_dma_sts_ready(d, dir)) crash_dma_sts_pop(d, dir);
+    }
+  }
+  chan->xfer_cnt_seen = crash_dma_xfer_cnt(d, dir);
+
+  list_for_each_entry_safe(req, tmp, &chan->inflight, list) {
+    list_del(&req->list);
+    crash_dma_req_complete(d, req, 0, (req == stuck) ? error : -ECANCELED);
+  }
+  chan->inflight_cnt = 0;
+
+  // Restart whatever is still waiting in the scheduler
+  crash_chan_service(d, dir);
+}
+
+// Retire completions on both channels. Without interrupts this is the only thing that makes progress.
+static void crash_service_all(struct crash_dev_drvdata *d)
+{
+  struct crash_dma_chan *chan;
+  unsigned long flags;
+  int dir;
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    chan = &d->chan[dir];
+    spin_lock_irqsave(&chan->lock, flags);
+    if (!chan->ring && !chan->lease) crash_chan_service(d, dir);
+    spin_unlock_irqrestore(&chan->lock, flags);
+  }
+  crash_trigs_dma(d);
+}
+
+// Queue a request and start it if the command FIFO has room
+static int crash_dma_queue(struct crash_dev_drvdata *d, struct crash_dma_req *req)
+{
+  struct crash_dma_chan *chan = &d->chan[req->dir];
+  unsigned long flags;
+  unsigned int completed;
+
+  spin_lock_irqsave(&chan->lock, flags);
+  // Streaming rings and exclusive channels own their direction
+  if (chan->ring || chan->lease) {
+    spin_unlock_irqrestore(&chan->lock, flags);
+    return -EBUSY;
+  }
+  req->queued = ktime_get();
+  crash_sched_enqueue(chan, req);
+  completed = crash_chan_service(d, req->dir);
+  spin_unlock_irqrestore(&chan->lock, flags);
+  if (completed) crash_trigs_dma(d);
+  return 0;
+}
+
+// Hand a pool buffer back, scrubbed so the next file descriptor does not see this one's data
+static void crash_pool_put(struct crash_dev_drvdata *d, struct crash_buff *b)
+{
+  unsigned long flags;
+
+  memset(b->cpu_addr, 0, b->len);
+  spin_lock_irqsave(&d->pool_lock, flags);
+  clear_bit(b->pool_idx, d->pool_used);
+  spin_unlock_irqrestore(&d->pool_lock, flags);
+}
+
+static int crash_pool_get(struct crash_dev_drvdata *d, struct crash_buff *b)
+{
+  unsigned long flags;
+  unsigned int i;
+
+  spin_lock_irqsave(&d->pool_lock, flags);
+  i = find_first_zero_bit(d->pool_used, d->pool_size);
+  if (i < d->pool_size) set_bit(i, d->pool_used);
+  spin_unlock_irqrestore(&d->pool_lock, flags);
+  if (i >= d->pool_size) return -ENOSPC;
+  *b = d->pool[i];
+  b->pooled = true;
+  b->pool_idx = i;
+  return 0;
+}
+
+static void crash_buffs_free(struct crash_private_data *pd)
+{
+  struct device *dev = &pd->d->pdev->dev;
+  struct crash_buff *b;
+  unsigned int i;
+
+  for (i = 0; i < pd->nbuffs; i++) {
+    b = &pd->buffs[i];
+    if (b->pooled) {
+      crash_pool_put(pd->d, b);
+    } else if (b->mode == CRASH_BUFF_STREAMING) {
+      dma_unmap_page(dev, b->dma_addr, b->len, DMA_BIDIRECTIONAL);
+      __free_pages(b->pages, b->order);
+    } else {
+      dma_free_coherent(dev, b->len, b->cpu_addr, b->dma_addr);
+    }
+  }
+  pd->nbuffs = 0;
+}
+
+// Streaming buffers are mapped bidirectionally as userspace decides per DMA which way they go
+static int crash_buff_alloc_one(struct device *dev, struct crash_buff *b, size_t size, uint32_t mode)
+{
+  b->mode = mode;
+  b->order = get_order(size);
+  b->len = PAGE_SIZE << b->order;
+  if (mode == CRASH_BUFF_STREAMING) {
+    b->pages = alloc_pages(GFP_KERNEL, b->order);
+    if (!b->pages) return -ENOMEM;
+    b->dma_addr = dma_map_page(dev, b->pages, 0, b->len, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(dev, b->dma_addr)) {
+      __free_pages(b->pages, b->order);
+      return -ENOMEM;
+    }
+  } else {
+    b->cpu_addr = dma_alloc_coherent(dev, b->len, &b->dma_addr, GFP_KERNEL);
+    if (!b->cpu_addr) return -ENOMEM;
+  }
+  return 0;
+}
+
+static int crash_buffs_alloc(struct crash_private_data *pd, unsigned int count, size_t size, uint32_t mode)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    // Buffers of the default kind come from the pool while it lasts
+    memset(&pd->buffs[i], 0, sizeof(struct crash_buff));
+    if (mode == CRASH_BUFF_COHERENT && d->pool_size && PAGE_SIZE << get_order(size) == d->pool[0].len &&
+        !crash_pool_get(d, &pd->buffs[i])) {
+      pd->nbuffs = i + 1;
+      continue;
+    }
+    if (crash_buff_alloc_one(&d->pdev->dev, &pd->buffs[i], size, mode)) {
+      crash_buffs_free(pd);
+      return -ENOMEM;
+    }
+    pd->nbuffs = i + 1;
+  }
+  return 0;
+}
+
+// Buffer 0 is attached on first use instead of at open, so opening the device is cheap and
+// only fails under memory pressure if the pool is exhausted too
+static int crash_buffs_attach(struct crash_private_data *pd)
+{
+  int result = 0;
+
+  if (READ_ONCE(pd->nbuffs)) return 0;
+  down_write(&pd->buffs_sem);
+  if (pd->nbuffs == 0) {
+    result = crash_buffs_alloc(pd, 1, (1 << PAGE_ORDER) * PAGE_SIZE, CRASH_BUFF_COHERENT);
+    if (result) {
+      dev_err(&pd->d->pdev->dev, "crash_buffs_attach(): Error allocating DMA buffer\n");
+    } else {
+      dev_info(&pd->d->pdev->dev, "crash_buffs_attach(): Attached %s DMA buffer\n", pd->buffs[0].pooled ? "pooled" : "new");
+    }
+  }
+  up_write(&pd->buffs_sem);
+  return result;
+}
+
+static struct crash_user_buff *crash_user_buff(struct crash_private_data *pd, uint32_t handle)
+{
+  struct crash_user_buff *ub;
+
+  if (handle < CRASH_USER_BUFF_BASE || handle >= CRASH_USER_BUFF(CRASH_MAX_USER_BUFFS)) return NULL;
+  ub = &pd->ubuffs[handle - CRASH_USER_BUFF_BASE];
+  return ub->pages ? ub : NULL;
+}
+
+static void crash_user_buff_free(struct crash_private_data *pd, struct crash_user_buff *ub)
+{
+  dma_unmap_sg(&pd->d->pdev->dev, ub->sgt.sgl, ub->sgt.orig_nents, DMA_BIDIRECTIONAL);
+  sg_free_table(&ub->sgt);
+  unpin_user_pages_dirty_lock(ub->pages, ub->npages, true);
+  kvfree(ub->pages);
+  ub->pages = NULL;
+}
+
+// Pin user memory and map it for DMA. Called with buffs_sem held for writing.
+static int crash_user_buff_register(struct crash_private_data *pd, struct crash_buff_register *reg)
+{
+  struct device *dev = &pd->d->pdev->dev;
+  struct crash_user_buff *ub = NULL;
+  unsigned long first, last;
+  unsigned int i;
+  int pinned, nents, result;
+
+  if (reg->len == 0 || reg->addr + reg->len < reg->addr) return -EINVAL;
+  for (i = 0; i < CRASH_MAX_USER_BUFFS; i++) {
+    if (!pd->ubuffs[i].pages) {
+      ub = &pd->ubuffs[i];
+      break;
+    }
+  }
+  if (!ub) return -ENOSPC;
+
+  first = reg->addr >> PAGE_SHIFT;
+  last = (reg->addr + reg->len - 1) >> PAGE_SHIFT;
+  ub->npages = last - first + 1;
+  ub->len = reg->len;
+  ub->pages = kvmalloc_array(ub->npages, sizeof(struct page *), GFP_KERNEL);
+  if (!ub->pages) return -ENOMEM;
+
+  pinned = pin_user_pages_fast(reg->addr & PAGE_MASK, ub->npages, FOLL_WRITE | FOLL_LONGTERM, ub->pages);
+  if (pinned != ub->npages) {
+    if (pinned > 0) unpin_user_pages(ub->pages, pinned);
+    result = pinned < 0 ? pinned : -EFAULT;
+    goto free_pages;
+  }
+
+  // Physically contiguous pages are merged into one entry
+  result = sg_alloc_table_from_pages(&ub->sgt, ub->pages, ub->npages, offset_in_page(reg->addr), reg->len, GFP_KERNEL);
+  if (result) goto unpin;
+  nents = dma_map_sg(dev, ub->sgt.sgl, ub->sgt.orig_nents, DMA_BIDIRECTIONAL);
+  if (nents <= 0) {
+    result = -ENOMEM;
+    goto free_table;
+  }
+  ub->sgt.nents = nents;
+
+  reg->handle = CRASH_USER_BUFF(i);
+  reg->nsegs = nents;
+  return 0;
+
+free_table:
+  sg_free_table(&ub->sgt);
+unpin:
+  unpin_user_pages(ub->pages, ub->npages);
+free_pages:
+  kvfree(ub->pages);
+  ub->pages = NULL;
+  return result;
+}
+
+static void crash_user_buffs_free(struct crash_private_data *pd)
+{
+  unsigned int i;
+
+  for (i = 0; i < CRASH_MAX_USER_BUFFS; i++) {
+    if (pd->ubuffs[i].pages) crash_user_buff_free(pd, &pd->ubuffs[i]);
+  }
+}
+
+// Exclusive channels look buffers up without buffs_sem, so the buffers must not change while the
+// file descriptor holds one. Called with buffs_sem held.
+static bool crash_leased(struct crash_private_data *pd)
+{
+  int dir;
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    if (pd->lease[dir] && pd->d->chan[dir].lease == pd->lease[dir]) return true;
+  }
+  return false;
+}
+
+// CRASH_REGISTER_BUFF / CRASH_UNREGISTER_BUFF. Like CRASH_ALLOC_BUFFS these wait for the
+// buffers to be idle.
+static int crash_register_buff(struct crash_private_data *pd, struct crash_buff_register *reg, bool unregister, uint32_t handle)
+{
+  struct crash_user_buff *ub;
+  unsigned long flags;
+  unsigned int outstanding;
+  int result = 0;
+
+  down_write(&pd->buffs_sem);
+  if (crash_leased(pd)) {
+    result = -EBUSY;
+    goto out;
+  }
+  if (unregister) {
+    ub = crash_user_buff(pd, handle);
+    if (!ub) {
+      result = -EINVAL;
+      goto out;
+    }
+    spin_lock_irqsave(&pd->evq_lock, flags);
+    outstanding = pd->outstanding;
+    spin_unlock_irqrestore(&pd->evq_lock, flags);
+    if (outstanding) {
+      result = -EBUSY;
+      goto out;
+    }
+    crash_user_buff_free(pd, ub);
+  } else {
+    result = crash_user_buff_register(pd, reg);
+    if (result) {
+      dev_err(&pd->d->pdev->dev, "crash_ioctl(): Error pinning user buffer (%d)\n", result);
+    } else {
+      dev_info(&pd->d->pdev->dev, "crash_ioctl(): Registered user buffer %u, %u bytes in %u segments\n", reg->handle, reg->len, reg->nsegs);
+    }
+  }
+out:
+  up_write(&pd->buffs_sem);
+  return result;
+}
+
+// Find the DMA address of a range of a user buffer. The range must be physically contiguous.
+static int crash_user_buff_addr(struct crash_user_buff *ub, uint32_t offset, uint32_t size, uint32_t *addr)
+{
+  struct scatterlist *sg;
+  unsigned int i;
+
+  if (offset > ub->len || size > ub->len - offset) return -EINVAL;
+  for_each_sg(ub->sgt.sgl, sg, ub->sgt.nents, i) {
+    if (offset < sg_dma_len(sg)) {
+      if (size > sg_dma_len(sg) - offset) return -EINVAL;
+      *addr = (uint32_t)sg_dma_address(sg) + offset;
+      return 0;
+    }
+    offset -= sg_dma_len(sg);
+  }
+  return -EINVAL;
+}
+
+static void crash_user_buff_sync(struct device *dev, struct crash_user_buff *ub, uint32_t offset, uint32_t len, bool for_cpu)
+{
+  struct scatterlist *sg;
+  uint32_t n;
+  unsigned int i;
+
+  for_each_sg(ub->sgt.sgl, sg, ub->sgt.nents, i) {
+    if (len == 0) break;
+    if (offset >= sg_dma_len(sg)) {
+      offset -= sg_dma_len(sg);
+      continue;
+    }
+    n = min(len, sg_dma_len(sg) - offset);
+    if (for_cpu) {
+      dma_sync_single_range_for_cpu(dev, sg_dma_address(sg), offset, n, DMA_BIDIRECTIONAL);
+    } else {
+      dma_sync_single_range_for_device(dev, sg_dma_address(sg), offset, n, DMA_BIDIRECTIONAL);
+    }
+    offset = 0;
+    len -= n;
+  }
+}
+
+// Translate a buffer index or user buffer handle and a range to a DMA address.
+// Called with buffs_sem held.
+static int crash_buff_addr(struct crash_private_data *pd, uint32_t buff, uint32_t offset, uint32_t size, uint32_t *addr)
+{
+  struct crash_user_buff *ub;
+  struct crash_buff *b;
+
+  ub = crash_user_buff(pd, buff);
+  if (ub) return crash_user_buff_addr(ub, offset, size, addr);
+  if (buff >= pd->nbuffs) return -EINVAL;
+  b = &pd->buffs[buff];
+  if (offset > b->len || size > b->len - offset) return -EINVAL;
+  *addr = (uint32_t)b->dma_addr + offset;
+  return 0;
+}
+
+// CRASH_SYNC_FOR_CPU / CRASH_SYNC_FOR_DEVICE. Coherent buffers need no maintenance.
+static int crash_buff_sync(struct crash_private_data *pd, struct crash_buff_sync *sync, bool for_cpu)
+{
+  struct device *dev = &pd->d->pdev->dev;
+  struct crash_user_buff *ub;
+  struct crash_buff *b;
+  int result = 0;
+
+  if (sync->buff < CRASH_USER_BUFF_BASE && crash_buffs_attach(pd)) return -ENOMEM;
+  down_read(&pd->buffs_sem);
+  ub = crash_user_buff(pd, sync->buff);
+  if (ub) {
+    if (sync->offset > ub->len || sync->len > ub->len - sync->offset) {
+      result = -EINVAL;
+    } else {
+      crash_user_buff_sync(dev, ub, sync->offset, sync->len, for_cpu);
+    }
+    goto out;
+  }
+  if (sync->buff >= pd->nbuffs) {
+    result = -EINVAL;
+    goto out;
+  }
+  b = &pd->buffs[sync->buff];
+  if (sync->offset > b->len || sync->len > b->len - sync->offset) {
+    result = -EINVAL;
+    goto out;
+  }
+  if (b->mode != CRASH_BUFF_STREAMING || sync->len == 0) goto out;
+  if (for_cpu) {
+    dma_sync_single_range_for_cpu(dev, b->dma_addr, sync->offset, sync->len, DMA_BIDIRECTIONAL);
+  } else {
+    dma_sync_single_range_for_device(dev, b->dma_addr, sync->offset, sync->len, DMA_BIDIRECTIONAL);
+  }
+out:
+  up_read(&pd->buffs_sem);
+  return result;
+}
+
+static int crash_alloc_buffs(struct crash_private_data *pd, struct crash_buff_alloc *alloc)
+{
+  unsigned long flags;
+  unsigned int outstanding;
+  int result;
+
+  if (alloc->count == 0 || alloc->count > CRASH_MAX_BUFFS) return -EINVAL;
+  if (alloc->size == 0 || alloc->size > CRASH_MAX_BUFF_SIZE) return -EINVAL;
+  if (alloc->mode != CRASH_BUFF_COHERENT && alloc->mode != CRASH_BUFF_STREAMING) return -EINVAL;
+
+  down_write(&pd->buffs_sem);
+  spin_lock_irqsave(&pd->evq_lock, flags);
+  outstanding = pd->outstanding;
+  spin_unlock_irqrestore(&pd->evq_lock, flags);
+  if (outstanding || atomic_read(&pd->buff_maps) || crash_leased(pd)) {
+    up_write(&pd->buffs_sem);
+    return -EBUSY;
+  }
+  crash_buffs_free(pd);
+  result = crash_buffs_alloc(pd, alloc->count, alloc->size, alloc->mode);
+  if (!result) alloc->size = pd->buffs[0].len;
+  up_write(&pd->buffs_sem);
+  if (result) {
+    dev_err(&pd->d->pdev->dev, "crash_ioctl(): Error allocating %u DMA buffers\n", alloc->count);
+  } else {
+    dev_info(&pd->d->pdev->dev, "crash_ioctl(): Allocated %u %s DMA buffers of %u bytes\n", alloc->count,
+             alloc->mode == CRASH_BUFF_STREAMING ? "streaming" : "coherent", alloc->size);
+  }
+  return result;
+}
+
+// Wait for a blocking DMA. Spin for spin_ns, then sleep on the interrupt or, with interrupts
+// disabled, poll with usleep_range() until the deadline. Returns 0, -ETIMEDOUT or -EINTR.
+static int crash_dma_wait(struct crash_private_data *pd, struct crash_dma_req *req, ktime_t start, u64 timeout_ns, u64 spin_ns)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[req->dir];
+  ktime_t deadline = ktime_add_ns(start, timeout_ns);
+  ktime_t spin_end = ktime_add_ns(start, min(spin_ns, timeout_ns));
+  unsigned long flags;
+  int result;
+
+  // Spin on the status register, which is the fastest way to see a short DMA finish
+  while (!READ_ONCE(req->done) && ktime_before(ktime_get(), spin_end)) {
+    if (signal_pending(current)) break;
+    spin_lock_irqsave(&chan->lock, flags);
+    crash_chan_service(d, req->dir);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    cpu_relax();
+  }
+  // Completions retired while spinning never reach the interrupt handler
+  crash_trigs_dma(d);
+  if (READ_ONCE(req->done)) return 0;
+
+  // Check if transfer interrupt is enabled.
+  if (crash_dma_irq_enabled(d, req->dir)) {
+    result = wait_event_interruptible_hrtimeout(chan->irq_wait, READ_ONCE(req->done), ktime_sub(deadline, ktime_get()));
+    if (result == -ETIME) {
+      dev_err(&d->pdev->dev, "crash_ioctl(): DMA timeout (Interrupt)\n");
+      return -ETIMEDOUT;
+    }
+    return result ? -EINTR : 0;
+  }
+
+  // Poll until DMA is complete or we timeout
+  while (!READ_ONCE(req->done)) {
+    if (!ktime_before(ktime_get(), deadline)) {
+      dev_err(&d->pdev->dev, "crash_ioctl(): DMA timeout (Polling)\n");
+      return -ETIMEDOUT;
+    }
+    if (signal_pending(current)) return -EINTR;
+    usleep_range(pd->poll.sleep_min_us, pd->poll.sleep_max_us);
+    spin_lock_irqsave(&chan->lock, flags);
+    crash_chan_service(d, req->dir);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    crash_trigs_dma(d);
+  }
+  return 0;
+}
+
+// Wait out a blocking DMA whose caller was interrupted after the DMA reached the command FIFO.
+// The hardware owns the buffer and other requests are queued behind it, so ignore signals and
+// only give up at the deadline. Returns 0 or -ETIMEDOUT.
+static int crash_dma_wait_issued(struct crash_private_data *pd, struct crash_dma_req *req, ktime_t deadline)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[req->dir];
+  unsigned long flags;
+
+  if (crash_dma_irq_enabled(d, req->dir)) {
+    if (wait_event_hrtimeout(chan->irq_wait, READ_ONCE(req->done), ktime_sub(deadline, ktime_get())) == -ETIME) {
+      return -ETIMEDOUT;
+    }
+    return 0;
+  }
+
+  while (!READ_ONCE(req->done)) {
+    if (!ktime_before(ktime_get(), deadline)) return -ETIMEDOUT;
+    usleep_range(pd->poll.sleep_min_us, pd->poll.sleep_max_us);
+    spin_lock_irqsave(&chan->lock, flags);
+    crash_chan_service(d, req->dir);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    crash_trigs_dma(d);
+  }
+  return 0;
+}
+
+// Blocking DMA on the file descriptor's DMA buffer
+static int crash_dma_xfer(struct crash_private_data *pd, struct crash_dma_xfer *x)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[x->dir];
+  struct crash_dma_req req;
+  uint32_t size = crash_cmd_size(x->cmd_data);
+  u64 timeout_ns, spin_ns, wait_ns;
+  unsigned long flags;
+  bool cancelled = false;
+  ktime_t start;
+  int result;
+
+  if (x->dir >= CRASH_NUM_DIRS) return -EINVAL;
+
+  timeout_ns = x->timeout_us ? (u64)x->timeout_us * NSEC_PER_USEC : (u64)INTERRUPT_TIMEOUT_MSEC * NSEC_PER_MSEC;
+  if (x->spin_us != CRASH_SPIN_DEFAULT) {
+    if (x->spin_us > READ_ONCE(poll_spin_max_us)) return -EINVAL;
+    spin_ns = (u64)x->spin_us * NSEC_PER_USEC;
+  } else {
+    spin_ns = (size <= pd->poll.spin_max_bytes) ? (u64)pd->poll.spin_us * NSEC_PER_USEC : 0;
+  }
+
+  memset(&req, 0, sizeof(struct crash_dma_req));
+  req.dir = x->dir;
+  req.cmd_data = x->cmd_data;
+  req.owner = pd;
+
+  if (x->buff < CRASH_USER_BUFF_BASE && crash_buffs_attach(pd)) return -ENOMEM;
+  down_read(&pd->buffs_sem);
+  result = crash_buff_addr(pd, x->buff, x->offset, size, &req.addr);
+  if (result) {
+    up_read(&pd->buffs_sem);
+    return result;
+  }
+  start = ktime_get();
+  if (down_read_interruptible(&chan->sem)) {
+    up_read(&pd->buffs_sem);
+    return -EINTR;
+  }
+  wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  atomic64_add(wait_ns, &chan->stats.mutex_wait_ns);
+  trace_crash_dma_mutex(x->dir, pd, wait_ns);
+  start = ktime_get();
+  result = crash_dma_queue(d, &req);
+  if (result) {
+    up_read(&chan->sem);
+    up_read(&pd->buffs_sem);
+    return result;
+  }
+
+  result = crash_dma_wait(pd, &req, start, timeout_ns, spin_ns);
+
+  // Timed out or interrupted before the DMA started, take the request back
+  spin_lock_irqsave(&chan->lock, flags);
+  if (!req.done && !req.issued) {
+    crash_sched_dequeue(chan, &req);
+    req.error = result;
+    cancelled = true;
+  }
+  spin_unlock_irqrestore(&chan->lock, flags);
+
+  if (!cancelled && !READ_ONCE(req.done)) {
+    // Interrupted with the DMA in flight, resetting the channel would fail everyone queued behind it
+    if (result == -EINTR) result = crash_dma_wait_issued(pd, &req, ktime_add_ns(start, timeout_ns));
+    if (result == -ETIMEDOUT) {
+      crash_chans_lock(d, &flags);
+      if (!req.done) crash_chan_abort(d, x->dir, &req, -ETIMEDOUT);
+      crash_chans_unlock(d, flags);
+      crash_trigs_dma(d);
+    }
+  }
+  if (req.error == -ETIMEDOUT) atomic64_inc(&chan->stats.timeouts);
+  x->wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  up_read(&chan->sem);
+  up_read(&pd->buffs_sem);
+  x->status = req.status;
+  x->stamp = req.stamp;
+  return req.error;
+}
+
+// CRASH_DMA_READ / CRASH_DMA_WRITE: DMA buffer 0, default deadline and poll policy
+static int crash_dma_xfer_legacy(struct crash_private_data *pd, int dir, uint32_t cmd_data)
+{
+  struct crash_dma_xfer x;
+
+  memset(&x, 0, sizeof(struct crash_dma_xfer));
+  x.dir = dir;
+  x.cmd_data = cmd_data;
+  x.spin_us = CRASH_SPIN_DEFAULT;
+  return crash_dma_xfer(pd, &x);
+}
+
+// Queue one asynchronous DMA, reserving room for its completion event, or completing ioucmd instead
+// if set. Called with buffs_sem held.
+static int crash_dma_submit_one(struct crash_private_data *pd, struct crash_dma_desc *desc,
+                                struct io_uring_cmd *ioucmd, gfp_t gfp)
+{
+  struct crash_dma_req *req;
+  uint32_t size = crash_cmd_size(desc->cmd_data);
+  unsigned long flags;
+  uint32_t addr;
+  int result;
+
+  if (desc->dir >= CRASH_NUM_DIRS || size == 0) return -EINVAL;
+  result = crash_buff_addr(pd, desc->buff, desc->offset, size, &addr);
+  if (result) return result;
+
+  req = kzalloc(sizeof(struct crash_dma_req), gfp);
+  if (!req) return -ENOMEM;
+  req->pd = pd;
+  req->owner = pd;
+  req->ioucmd = ioucmd;
+  req->dir = desc->dir;
+  req->addr = addr;
+  req->cmd_data = desc->cmd_data;
+  req->user_data = desc->user_data;
+
+  spin_lock_irqsave(&pd->evq_lock, flags);
+  if (pd->outstanding + kfifo_len(&pd->evq) >= CRASH_EVENT_QUEUE_LEN) {
+    spin_unlock_irqrestore(&pd->evq_lock, flags);
+    kfree(req);
+    return -EAGAIN;
+  }
+  pd->outstanding++;
+  spin_unlock_irqrestore(&pd->evq_lock, flags);
+
+  if (ioucmd) crash_uring_pdu(ioucmd)->req = req;
+  result = crash_dma_queue(pd->d, req);
+  if (result) {
+    if (ioucmd) crash_uring_pdu(ioucmd)->req = NULL;
+    spin_lock_irqsave(&pd->evq_lock, flags);
+    pd->outstanding--;
+    spin_unlock_irqrestore(&pd->evq_lock, flags);
+    kfree(req);
+  }
+  return result;
+}
+
+static long crash_dma_submit(struct crash_private_data *pd, struct crash_dma_submit __user *usub)
+{
+  struct crash_dma_submit sub;
+  struct crash_dma_desc desc;
+  struct crash_dma_desc __user *udesc;
+  int result = 0;
+
+  if (copy_from_user(&sub, usub, sizeof(struct crash_dma_submit))) return -EFAULT;
+  udesc = (struct crash_dma_desc __user *)(uintptr_t)sub.descs;
+
+  if (crash_buffs_attach(pd)) return -ENOMEM;
+  down_read(&pd->buffs_sem);
+  for (sub.submitted = 0; sub.submitted < sub.count; sub.submitted++) {
+    if (copy_from_user(&desc, &udesc[sub.submitted], sizeof(struct crash_dma_desc))) {
+      result = -EFAULT;
+      break;
+    }
+    result = crash_dma_submit_one(pd, &desc, NULL, GFP_KERNEL);
+    if (result) break;
+  }
+  up_read(&pd->buffs_sem);
+
+  if (put_user(sub.submitted, &usub->submitted)) return -EFAULT;
+  // Partial batches succeed, the caller resubmits the rest
+  if (sub.submitted) return 0;
+  return result;
+}
+
+// Subscribe to or unsubscribe from device events: sub is pd->thresh_sub or pd->fifo_sub. The file
+// descriptor stays on d->thresh_fds while it has either.
+static void crash_events_subscribe(struct crash_private_data *pd, bool *sub, bool en)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  unsigned long flags;
+  bool was;
+
+  spin_lock_irqsave(&d->thresh_lock, flags);
+  was = pd->thresh_sub || pd->fifo_sub;
+  *sub = en;
+  if (!was && en) {
+    list_add_tail(&pd->thresh_node, &d->thresh_fds);
+  } else if (was && !pd->thresh_sub && !pd->fifo_sub) {
+    list_del_init(&pd->thresh_node);
+  }
+  spin_unlock_irqrestore(&d->thresh_lock, flags);
+}
+
+// Queue a device event to every file descriptor subscribed to it. Producers hold thresh_lock and
+// read() is the only consumer of each queue, so the kfifo needs no lock between them.
+// Called with thresh_lock held.
+static void crash_events_post(struct crash_dev_drvdata *d, struct crash_event *ev)
+{
+  struct crash_private_data *pd;
+
+  list_for_each_entry(pd, &d->thresh_fds, thresh_node) {
+    if (!(ev->type == CRASH_EVENT_THRESHOLD ? pd->thresh_sub : pd->fifo_sub)) continue;
+    if (ev->type == CRASH_EVENT_THRESHOLD) {
+      ev->u.thresh.lost = pd->thq_lost;
+    } else {
+      ev->u.fifo.lost = pd->thq_lost;
+    }
+    if (kfifo_put(&pd->thq, *ev)) {
+      pd->thq_lost = 0;
+      wake_up_interruptible(&pd->evq_wait);
+    } else {
+      pd->thq_lost++;
+    }
+  }
+}
+
+// Latch a threshold crossing and queue it to every subscriber.
+// Returns 1 if the threshold interrupt was pending.
+static unsigned int crash_thresh_service(struct crash_dev_drvdata *d)
+{
+  volatile uint32_t *regs = d->regs;
+  struct crash_event ev;
+  unsigned long flags;
+  uint32_t bank;
+
+  if (!crash_shadow_get_bit(d, SPEC_SENSE_ENABLE_THRESHOLD_IRQ)) return 0;
+  bank = crash_read_reg(regs, SPEC_SENSE_BANK3);
+  if (!((bank >> SPEC_SENSE_THRESHOLD_EXCEEDED_OFFSET) & 1)) return 0;
+
+  memset(&ev, 0, sizeof(struct crash_event));
+  ev.type = CRASH_EVENT_THRESHOLD;
+  ev.u.thresh.timestamp_ns = ktime_get_ns();
+  ev.u.thresh.index = (bank >> SPEC_SENSE_THRESHOLD_EXCEEDED_INDEX_OFFSET) & ((1 << SPEC_SENSE_THRESHOLD_EXCEEDED_INDEX_N)-1);
+  ev.u.thresh.mag = crash_read_reg(regs, SPEC_SENSE_THRESHOLD_EXCEEDED_MAG);
+  // Rearm the latch for the next crossing
+  crash_shadow_set_bit(d, SPEC_SENSE_CLEAR_THRESHOLD_LATCHED);
+  crash_shadow_clear_bit(d, SPEC_SENSE_CLEAR_THRESHOLD_LATCHED);
+
+  spin_lock_irqsave(&d->thresh_lock, flags);
+  crash_events_post(d, &ev);
+  spin_unlock_irqrestore(&d->thresh_lock, flags);
+  crash_trigs_event(d, CRASH_TRIG_THRESHOLD);
+  return 1;
+}
+
+static inline bool crash_events_ready(struct crash_private_data *pd)
+{
+  return !kfifo_is_empty(&pd->evq) || !kfifo_is_empty(&pd->thq);
+}
+
+static unsigned int crash_outstanding(struct crash_private_data *pd)
+{
+  unsigned long flags;
+  unsigned int n;
+
+  spin_lock_irqsave(&pd->evq_lock, flags);
+  n = pd->outstanding;
+  spin_unlock_irqrestore(&pd->evq_lock, flags);
+  return n;
+}
+
+// Ring slots are streaming mappings owned by the driver, which syncs them as it hands them
+// between the DMA and userspace
+static inline enum dma_data_direction crash_ring_dma_dir(struct crash_ring *r)
+{
+  return (r->dir == CRASH_DIR_S2MM) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+}
+
+static void crash_ring_free(struct device *dev, struct crash_ring *r)
+{
+  unsigned int i;
+
+  for (i = 0; i < r->nslots; i++) {
+    if (!r->slots[i]) continue;
+    if (r->slot_dma[i]) dma_unmap_page(dev, r->slot_dma[i], r->slot_size, crash_ring_dma_dir(r));
+    __free_pages(r->slots[i], r->order);
+  }
+  if (r->ctrl) free_page((unsigned long)r->ctrl);
+  kfree(r);
+}
+
+static struct crash_ring *crash_ring_alloc(struct device *dev, struct crash_ring_config *cfg)
+{
+  struct crash_ring *r;
+  unsigned int i;
+
+  if (cfg->nslots == 0 || cfg->nslots > CRASH_RING_MAX_SLOTS) return ERR_PTR(-EINVAL);
+  if (cfg->slot_size == 0 || cfg->slot_size > (1 << PAGE_ORDER) * PAGE_SIZE) return ERR_PTR(-EINVAL);
+
+  r = kzalloc(sizeof(struct crash_ring), GFP_KERNEL);
+  if (!r) return ERR_PTR(-ENOMEM);
+  r->dir = cfg->dir;
+  r->nslots = cfg->nslots;
+  r->order = get_order(cfg->slot_size);
+  r->slot_size = PAGE_SIZE << r->order;
+  r->cmd_data = cfg->cmd_data;
+  r->flags = cfg->flags;
+
+  r->ctrl = (struct crash_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+  if (!r->ctrl) goto nomem;
+  for (i = 0; i < r->nslots; i++) {
+    r->slots[i] = alloc_pages(GFP_KERNEL, r->order);
+    if (!r->slots[i]) goto nomem;
+    r->slot_dma[i] = dma_map_page(dev, r->slots[i], 0, r->slot_size, crash_ring_dma_dir(r));
+    if (dma_mapping_error(dev, r->slot_dma[i])) {
+      r->slot_dma[i] = 0;
+      goto nomem;
+    }
+  }
+  r->ctrl->nslots = r->nslots;
+  r->ctrl->slot_size = r->slot_size;
+  r->ctrl->data_offset = PAGE_SIZE;
+  return r;
+
+nomem:
+  crash_ring_free(dev, r);
+  return ERR_PTR(-ENOMEM);
+}
+
+static void crash_ring_push_slot(struct crash_dev_drvdata *d, struct crash_ring *r, unsigned int slot)
+{
+  dma_sync_single_for_device(&d->pdev->dev, r->slot_dma[slot], r->slot_size, crash_ring_dma_dir(r));
+  r->slot_pushed[slot] = ktime_get();
+  trace_crash_dma_cmd(r->dir, r->pd, (uint32_t)r->slot_dma[slot], r->cmd_data);
+  crash_dma_push_cmd(d, r->dir, (uint32_t)r->slot_dma[slot], r->cmd_data);
+}
+
+// Retire completed slots, publish them to userspace and refill the command FIFO.
+// Called with chan->lock held. Returns the number of slots that completed.
+static unsigned int crash_ring_service(struct crash_dev_drvdata *d, struct crash_ring *r)
+{
+  struct crash_ring_ctrl *ctrl = r->ctrl;
+  unsigned int completed = 0;
+  uint32_t user, limit;
+
+  // In loop mode slots past this index have not been released by userspace
+  user = (r->dir == CRASH_DIR_S2MM) ? READ_ONCE(ctrl->tail) + r->nslots : READ_ONCE(ctrl->head);
+
+  while (r->submitted != r->done && crash_dma_sts_ready(d, r->dir)) {
+    if (!completed) crash_chan_stamp(d, r->dir);
+    crash_dma_sts_pop(d, r->dir);
+    crash_stamp(d, r->dir, r->cmd_data, &ctrl->stamps[r->done % r->nslots]);
+    dma_sync_single_for_cpu(&d->pdev->dev, r->slot_dma[r->done % r->nslots], r->slot_size, crash_ring_dma_dir(r));
+    // In loop mode the slot was queued once, so only the first pass has a meaningful latency
+    crash_stats_complete(&d->chan[r->dir].stats, crash_cmd_size(r->cmd_data), r->slot_pushed[r->done % r->nslots], 0);
+    r->slot_pushed[r->done % r->nslots] = ktime_get();
+    r->done++;
+    completed++;
+    // In loop mode the DMA keeps going around the ring, so the command is still queued
+    if (r->flags & CRASH_RING_LOOP) {
+      r->submitted++;
+      if ((int32_t)(r->done - user) > 0) ctrl->overruns++;
+    }
+  }
+
+  if (completed) {
+    // Make sure DMA'd data is visible before the index that publishes it
+    smp_wmb();
+    if (r->dir == CRASH_DIR_S2MM) {
+      WRITE_ONCE(ctrl->head, r->done);
+    } else {
+      WRITE_ONCE(ctrl->tail, r->done);
+    }
+  }
+
+  if (!(r->flags & CRASH_RING_LOOP)) {
+    // S2MM can fill every slot userspace has consumed, MM2S can send every slot userspace has filled
+    if (r->dir == CRASH_DIR_S2MM) {
+      limit = READ_ONCE(ctrl->tail) + r->nslots;
+      if ((int32_t)(limit - r->done) > (int32_t)r->nslots) limit = r->done + r->nslots;
+    } else {
+      limit = READ_ONCE(ctrl->head);
+      if ((int32_t)(limit - r->done) > (int32_t)r->nslots) limit = r->done + r->nslots;
+    }
+    while ((int32_t)(limit - r->submitted) > 0) {
+      crash_ring_push_slot(d, r, r->submitted % r->nslots);
+      r->submitted++;
+    }
+    if (r->submitted == r->done) {
+      ctrl->flags |= CRASH_RING_NEED_KICK;
+    } else {
+      ctrl->flags &= ~CRASH_RING_NEED_KICK;
+    }
+  }
+
+  if (completed) wake_up_interruptible(&d->chan[r->dir].ring_wait);
+  return completed;
+}
+
+static int crash_ring_start(struct crash_private_data *pd, struct crash_ring_config *cfg)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[cfg->dir];
+  struct crash_ring *r;
+  uint32_t size = cfg->cmd_data & ((1 << DMA_S2MM_CMD_SIZE_N)-1);
+  unsigned long flags;
+  unsigned int i;
+  int result = 0;
+
+  if (size == 0 || size > cfg->slot_size) return -EINVAL;
+  // Slots are streaming mappings synced when queued, which a looping MM2S ring only does for the
+  // first pass. Later writes could sit in the CPU cache while the DMA resends the slot.
+  if ((cfg->flags & CRASH_RING_LOOP) && cfg->dir == CRASH_DIR_MM2S) return -EINVAL;
+
+  // The channel semaphores also serialize concurrent starts on this file descriptor, so only one
+  // of them allocates the ring.
+  if (crash_mutexes_lock(d)) return -EINTR;
+
+  // Ring memory stays with the file descriptor until close as userspace may still have it mapped,
+  // so a restarted ring must keep its geometry.
+  r = pd->ring[cfg->dir];
+  if (r) {
+    if (r->nslots != cfg->nslots || r->slot_size != (PAGE_SIZE << get_order(cfg->slot_size))) {
+      crash_mutexes_unlock(d);
+      return -EBUSY;
+    }
+  } else {
+    r = crash_ring_alloc(&d->pdev->dev, cfg);
+    if (IS_ERR(r)) {
+      crash_mutexes_unlock(d);
+      return PTR_ERR(r);
+    }
+    pd->ring[cfg->dir] = r;
+  }
+
+  crash_chans_lock(d, &flags);
+  if (!crash_chan_idle(chan)) {
+    result = -EBUSY;
+    goto unlock;
+  }
+  // Switching the status FIFO mode is only safe while nothing is in flight
+  if (!d->sts_auto_read) {
+    if (!crash_chan_idle(&d->chan[!cfg->dir])) {
+      result = -EBUSY;
+      goto unlock;
+    }
+    crash_dma_set_sts_auto_read(d, true);
+  }
+
+  r->cmd_data = cfg->cmd_data;
+  r->flags = cfg->flags;
+  r->pd = pd;
+  r->submitted = 0;
+  r->done = 0;
+  r->ctrl->head = 0;
+  r->ctrl->tail = 0;
+  r->ctrl->flags = 0;
+  r->ctrl->overruns = 0;
+
+  // The ring is driven from the interrupt handler
+  if (cfg->dir == CRASH_DIR_S2MM) {
+    crash_shadow_set_bit(d, DMA_S2MM_INTERRUPT);
+  } else {
+    crash_shadow_set_bit(d, DMA_MM2S_INTERRUPT);
+  }
+
+  chan->ring = r;
+  if (r->flags & CRASH_RING_LOOP) {
+    if (cfg->dir == CRASH_DIR_S2MM) {
+      crash_shadow_write_reg(d, DMA_S2MM_CMD_FIFO_LOOP, r->nslots);
+    } else {
+      crash_shadow_write_reg(d, DMA_MM2S_CMD_FIFO_LOOP, r->nslots);
+    }
+    for (i = 0; i < r->nslots; i++) {
+      crash_ring_push_slot(d, r, i);
+    }
+    r->submitted = r->nslots;
+  } else {
+    crash_ring_service(d, r);
+  }
+  crash_dma_xfer_en(d, r->dir, true);
+  chan->xfer_en = true;
+  dev_info(&d->pdev->dev, "crash_ring_start(): Started %s ring with %u slots\n", cfg->dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S", r->nslots);
+
+unlock:
+  crash_chans_unlock(d, flags);
+  crash_mutexes_unlock(d);
+  return result;
+}
+
+static int crash_ring_stop(struct crash_private_data *pd, int dir)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[dir];
+  unsigned long flags;
+
+  down_write(&d->chan[CRASH_DIR_MM2S].sem);
+  down_write(&d->chan[CRASH_DIR_S2MM].sem);
+  crash_chans_lock(d, &flags);
+  if (!pd->ring[dir] || chan->ring != pd->ring[dir]) {
+    crash_chans_unlock(d, flags);
+    crash_mutexes_unlock(d);
+    return -EINVAL;
+  }
+
+  crash_dma_xfer_en(d, dir, false);
+  chan->xfer_en = false;
+  if (dir == CRASH_DIR_S2MM) {
+    crash_shadow_write_reg(d, DMA_S2MM_CMD_FIFO_LOOP, 0);
+  } else {
+    crash_shadow_write_reg(d, DMA_MM2S_CMD_FIFO_LOOP, 0);
+  }
+  crash_dma_reset_cmd_fifo(d, dir);
+  chan->ring = NULL;
+
+  // Go back to reading the status FIFO once nothing depends on auto read. If the other direction
+  // is busy, stay in auto read mode, the DMA paths handle both.
+  if (crash_chan_idle(&d->chan[CRASH_DIR_MM2S]) && crash_chan_idle(&d->chan[CRASH_DIR_S2MM])) {
+    crash_dma_set_sts_auto_read(d, false);
+  }
+  crash_chans_unlock(d, flags);
+  crash_mutexes_unlock(d);
+
+  wake_up_interruptible(&chan->ring_wait);
+  dev_info(&d->pdev->dev, "crash_ring_stop(): Stopped %s ring\n", dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S");
+  return 0;
+}
+
+// Check if userspace has something to do: S2MM slots to consume, MM2S slots to fill
+static bool crash_ring_ready(struct crash_dma_chan *chan, struct crash_ring *r)
+{
+  if (chan->ring != r) return true;
+  if (r->dir == CRASH_DIR_S2MM) return READ_ONCE(r->ctrl->tail) != r->done;
+  return (uint32_t)(READ_ONCE(r->ctrl->head) - r->done) < r->nslots;
+}
+
+// Count a USRP FIFO overflow / underflow episode and tell subscribers. Called with status_lock held.
+static void crash_fifo_event(struct crash_dev_drvdata *d, int dir, uint32_t count)
+{
+  struct crash_event ev;
+  unsigned long flags;
+
+  atomic64_inc(&d->chan[dir].stats.fifo_errors);
+  memset(&ev, 0, sizeof(struct crash_event));
+  ev.type = CRASH_EVENT_FIFO;
+  ev.u.fifo.dir = dir;
+  ev.u.fifo.tdest = (dir == CRASH_DIR_S2MM) ? crash_read_reg_shadow(d->shadow, USRP_AXIS_MASTER_TDEST) : 0;
+  ev.u.fifo.timestamp_ns = ktime_get_ns();
+  ev.u.fifo.count = count;
+  spin_lock_irqsave(&d->thresh_lock, flags);
+  crash_events_post(d, &ev);
+  spin_unlock_irqrestore(&d->thresh_lock, flags);
+}
+
+// Publish USRP_BANK7 and the transfer counters on the status page. The USRP FIFO flags are sticky,
+// each one found set is an episode, cleared here so the next one can be seen.
+static void crash_status_update(struct crash_dev_drvdata *d)
+{
+  struct crash_status_page *s = d->status;
+  uint32_t bank7;
+  unsigned long flags;
+  int dir;
+
+  spin_lock_irqsave(&d->status_lock, flags);
+  bank7 = d->regs[USRP_BANK7_BASE];
+  WRITE_ONCE(s->seq, s->seq + 1);
+  smp_wmb();
+  if ((bank7 >> USRP_RX_FIFO_OVERFLOW_OFFSET) & 1) {
+    crash_shadow_set_bit(d, USRP_RX_FIFO_OVERFLOW_CLR);
+    crash_shadow_clear_bit(d, USRP_RX_FIFO_OVERFLOW_CLR);
+    crash_fifo_event(d, CRASH_DIR_S2MM, ++s->rx_overflows);
+  }
+  if ((bank7 >> USRP_TX_FIFO_UNDERFLOW_OFFSET) & 1) {
+    crash_shadow_set_bit(d, USRP_TX_FIFO_UNDERFLOW_CLR);
+    crash_shadow_clear_bit(d, USRP_TX_FIFO_UNDERFLOW_CLR);
+    crash_fifo_event(d, CRASH_DIR_MM2S, ++s->tx_underflows);
+  }
+  s->usrp_bank7 = bank7;
+  s->updated_ns = ktime_get_ns();
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    s->transfers[dir] = atomic64_read(&d->chan[dir].stats.transfers);
+  }
+  smp_wmb();
+  WRITE_ONCE(s->seq, s->seq + 1);
+  spin_unlock_irqrestore(&d->status_lock, flags);
+}
+
+// Catch FIFO errors while no interrupts arrive, e.g. RX overflowing because nobody reads
+static enum hrtimer_restart crash_monitor(struct hrtimer *t)
+{
+  struct crash_dev_drvdata *d = container_of(t, struct crash_dev_drvdata, monitor);
+
+  crash_status_update(d);
+  hrtimer_forward_now(t, us_to_ktime(monitor_us));
+  return HRTIMER_RESTART;
+}
+
+static void crash_lease_free(struct crash_lease *l)
+{
+  vfree(l->ctrl);
+  kfree(l);
+}
+
+static struct crash_lease *crash_lease_alloc(struct crash_lease_config *cfg)
+{
+  size_t sq_len = PAGE_ALIGN(cfg->entries * sizeof(struct crash_sqe));
+  size_t cq_len = PAGE_ALIGN(cfg->entries * sizeof(struct crash_cqe));
+  struct crash_lease *l;
+
+  l = kzalloc(sizeof(struct crash_lease), GFP_KERNEL);
+  if (!l) return ERR_PTR(-ENOMEM);
+  l->len = PAGE_SIZE + sq_len + cq_len;
+  l->ctrl = vmalloc_user(l->len);
+  if (!l->ctrl) {
+    kfree(l);
+    return ERR_PTR(-ENOMEM);
+  }
+  l->dir = cfg->dir;
+  l->entries = cfg->entries;
+  l->sq = (struct crash_sqe *)((char *)l->ctrl + PAGE_SIZE);
+  l->cq = (struct crash_cqe *)((char *)l->ctrl + PAGE_SIZE + sq_len);
+  l->ctrl->entries = l->entries;
+  l->ctrl->sq_offset = PAGE_SIZE;
+  l->ctrl->cq_offset = PAGE_SIZE + sq_len;
+  init_waitqueue_head(&l->wait);
+  return l;
+}
+
+// Post a CQE, returning it so completed DMAs can be stamped
+static struct crash_cqe *crash_lease_cqe(struct crash_lease *l, uint64_t user_data, uint32_t status, int error, uint32_t bytes)
+{
+  struct crash_cqe *cqe = &l->cq[l->cq_tail & (l->entries - 1)];
+
+  cqe->user_data = user_data;
+  cqe->status = status;
+  cqe->error = error;
+  cqe->bytes = bytes;
+  cqe->reserved = 0;
+  memset(&cqe->stamp, 0, sizeof(struct crash_stamp));
+  l->cq_tail++;
+  return cqe;
+}
+
+// Complete the oldest command in the FIFO. Called with chan->lock held.
+static void crash_lease_complete(struct crash_dev_drvdata *d, struct crash_lease *l, uint32_t status, int error)
+{
+  unsigned int slot = l->done % CRASH_DMA_INFLIGHT_MAX;
+  uint32_t size = crash_cmd_size(l->cmd_data[slot]);
+  struct crash_cqe *cqe;
+
+  trace_crash_dma_complete(l->dir, l->pd, l->cmd_data[slot], error, ktime_to_ns(ktime_sub(ktime_get(), l->queued[slot])));
+  crash_stats_complete(&d->chan[l->dir].stats, size, l->queued[slot], error);
+  cqe = crash_lease_cqe(l, l->user_data[slot], status, error, error ? 0 : size);
+  if (!error) crash_stamp(d, l->dir, l->cmd_data[slot], &cqe->stamp);
+  l->done++;
+}
+
+// Retire completions into the CQ and feed SQEs to the command FIFO.
+// Called with chan->lock held. Returns the number of DMAs that completed.
+static unsigned int crash_lease_service(struct crash_dev_drvdata *d, struct crash_lease *l)
+{
+  struct crash_lease_ctrl *ctrl = l->ctrl;
+  unsigned int completed = 0, slot;
+  uint32_t sq_tail, cq_used, room, size, addr;
+  struct crash_sqe sqe;
+
+  while (l->issued != l->done && crash_dma_sts_ready(d, l->dir)) {
+    if (!completed) crash_chan_stamp(d, l->dir);
+    crash_lease_complete(d, l, crash_dma_sts_pop(d, l->dir), 0);
+    completed++;
+  }
+
+  sq_tail = READ_ONCE(ctrl->sq_tail);
+  if (sq_tail - l->sq_head > l->entries) sq_tail = l->sq_head + l->entries;
+  // Read the SQEs only after the index that publishes them
+  smp_rmb();
+  // Every SQE taken needs a CQE, including the ones still in flight
+  cq_used = l->cq_tail - READ_ONCE(ctrl->cq_head) + (l->issued - l->done);
+  room = (cq_used < l->entries) ? l->entries - cq_used : 0;
+  while (l->sq_head != sq_tail && room && l->issued - l->done < CRASH_DMA_INFLIGHT_MAX) {
+    memcpy(&sqe, &l->sq[l->sq_head & (l->entries - 1)], sizeof(struct crash_sqe));
+    l->sq_head++;
+    room--;
+    // A command without EN would never complete
+    size = crash_cmd_size(sqe.cmd_data);
+    if (size == 0 || !((sqe.cmd_data >> DMA_S2MM_CMD_EN_OFFSET) & 1) ||
+        crash_buff_addr(l->pd, sqe.buff, sqe.offset, size, &addr)) {
+      crash_lease_cqe(l, sqe.user_data, 0, -EINVAL, 0);
+      continue;
+    }
+    slot = l->issued % CRASH_DMA_INFLIGHT_MAX;
+    l->user_data[slot] = sqe.user_data;
+    l->cmd_data[slot] = sqe.cmd_data;
+    l->queued[slot] = ktime_get();
+    l->issued++;
+    trace_crash_dma_cmd(l->dir, l->pd, addr, sqe.cmd_data);
+    crash_dma_push_cmd(d, l->dir, addr, sqe.cmd_data);
+  }
+  WRITE_ONCE(ctrl->sq_head, l->sq_head);
+  // Make sure the CQEs are visible before the index that publishes them
+  smp_wmb();
+  WRITE_ONCE(ctrl->cq_tail, l->cq_tail);
+  return completed;
+}
+
+// Without the interrupt only the thread retires completions
+static inline bool crash_lease_must_poll(struct crash_dev_drvdata *d, struct crash_lease *l)
+{
+  return l->issued != l->done && !crash_dma_irq_enabled(d, l->dir);
+}
+
+static bool crash_lease_wake_cond(struct crash_dev_drvdata *d, struct crash_lease *l)
+{
+  if (kthread_should_stop()) return true;
+  if (d->chan[l->dir].lease != l) return false;
+  return READ_ONCE(l->ctrl->sq_tail) != l->sq_head || crash_lease_must_poll(d, l);
+}
+
+// Busy polls the SQ and the status FIFO while there is work. After idle_us without any it sets
+// CRASH_LEASE_NEED_WAKEUP and sleeps until CRASH_CHAN_WAKE.
+static int crash_lease_thread(void *data)
+{
+  struct crash_lease *l = data;
+  struct crash_dev_drvdata *d = l->pd->d;
+  struct crash_dma_chan *chan = &d->chan[l->dir];
+  ktime_t active = ktime_get();
+  uint32_t sq_head, done;
+  unsigned long flags;
+  bool leased;
+
+  while (!kthread_should_stop()) {
+    spin_lock_irqsave(&chan->lock, flags);
+    leased = (chan->lease == l);
+    sq_head = l->sq_head;
+    done = l->done;
+    if (leased) crash_lease_service(d, l);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    crash_trigs_dma(d);
+    // The status page costs an uncached read, refresh it only when completions were retired and
+    // leave idle spins to the monitor timer
+    if (leased && l->done != done) crash_status_update(d);
+
+    if (leased && (l->sq_head != sq_head || l->done != done)) {
+      active = ktime_get();
+    } else if (!leased || (ktime_us_delta(ktime_get(), active) >= l->idle_us && !crash_lease_must_poll(d, l))) {
+      WRITE_ONCE(l->ctrl->flags, l->ctrl->flags | CRASH_LEASE_NEED_WAKEUP);
+      // Pairs with userspace advancing sq_tail before it checks the flag
+      smp_mb();
+      wait_event_interruptible(l->wait, crash_lease_wake_cond(d, l));
+      WRITE_ONCE(l->ctrl->flags, l->ctrl->flags & ~CRASH_LEASE_NEED_WAKEUP);
+      active = ktime_get();
+    }
+    cond_resched();
+  }
+  return 0;
+}
+
+static int crash_lease_start(struct crash_private_data *pd, struct crash_lease_config *cfg)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[cfg->dir];
+  struct crash_lease *l;
+  struct task_struct *thread;
+  unsigned long flags;
+  int result = 0;
+
+  if (cfg->entries == 0 || cfg->entries > CRASH_LEASE_MAX_ENTRIES || !is_power_of_2(cfg->entries)) return -EINVAL;
+
+  // Like ring memory, the queues stay with the file descriptor until close as userspace may still
+  // have them mapped, so a new lease must keep their size. The channel semaphores serialize this
+  // with other starts and with mmap, see crash_ring_start().
+  if (crash_mutexes_lock(d)) return -EINTR;
+  l = pd->lease[cfg->dir];
+  if (l) {
+    if (l->entries != cfg->entries) {
+      crash_mutexes_unlock(d);
+      return -EBUSY;
+    }
+  } else {
+    l = crash_lease_alloc(cfg);
+    if (IS_ERR(l)) {
+      crash_mutexes_unlock(d);
+      return PTR_ERR(l);
+    }
+    l->pd = pd;
+    pd->lease[cfg->dir] = l;
+  }
+  crash_mutexes_unlock(d);
+
+  if (crash_buffs_attach(pd)) return -ENOMEM;
+  thread = kthread_create(crash_lease_thread, l, "%s-%s", d->name, cfg->dir == CRASH_DIR_S2MM ? "s2mm" : "mm2s");
+  if (IS_ERR(thread)) return PTR_ERR(thread);
+
+  // buffs_sem keeps the buffers from changing until crash_leased() sees the lease
+  down_read(&pd->buffs_sem);
+  if (crash_mutexes_lock(d)) {
+    up_read(&pd->buffs_sem);
+    kthread_stop(thread);
+    return -EINTR;
+  }
+  crash_chans_lock(d, &flags);
+  if (!crash_chan_idle(chan)) {
+    result = -EBUSY;
+    goto unlock;
+  }
+
+  l->idle_us = cfg->idle_us ? cfg->idle_us : CRASH_LEASE_IDLE_US_DEFAULT;
+  l->sq_head = 0;
+  l->cq_tail = 0;
+  l->issued = 0;
+  l->done = 0;
+  l->ctrl->sq_head = 0;
+  l->ctrl->sq_tail = 0;
+  l->ctrl->cq_head = 0;
+  l->ctrl->cq_tail = 0;
+  l->ctrl->flags = 0;
+  l->thread = thread;
+  chan->lease = l;
+  crash_dma_xfer_en(d, cfg->dir, true);
+  chan->xfer_en = true;
+  cfg->mmap_len = l->len;
+
+unlock:
+  crash_chans_unlock(d, flags);
+  crash_mutexes_unlock(d);
+  up_read(&pd->buffs_sem);
+  if (result) {
+    kthread_stop(thread);
+    return result;
+  }
+  wake_up_process(thread);
+  dev_info(&d->pdev->dev, "crash_lease_start(): Leased %s channel with %u entries\n", cfg->dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S", l->entries);
+  return 0;
+}
+
+static int crash_lease_stop(struct crash_private_data *pd, int dir)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_chan *chan = &d->chan[dir];
+  struct crash_lease *l = pd->lease[dir];
+  struct task_struct *thread;
+  unsigned long flags;
+
+  down_write(&d->chan[CRASH_DIR_MM2S].sem);
+  down_write(&d->chan[CRASH_DIR_S2MM].sem);
+  crash_chans_lock(d, &flags);
+  if (!l || chan->lease != l) {
+    crash_chans_unlock(d, flags);
+    crash_mutexes_unlock(d);
+    return -EINVAL;
+  }
+
+  crash_dma_xfer_en(d, dir, false);
+  chan->xfer_en = false;
+  crash_dma_reset_cmd_fifo(d, dir);
+  while (l->issued != l->done) {
+    crash_lease_complete(d, l, 0, -ECANCELED);
+  }
+  smp_wmb();
+  WRITE_ONCE(l->ctrl->cq_tail, l->cq_tail);
+  chan->lease = NULL;
+  thread = l->thread;
+  l->thread = NULL;
+
+  // Go back to reading the status FIFO once nothing depends on auto read
+  if (d->sts_auto_read && crash_chan_idle(&d->chan[CRASH_DIR_MM2S]) && crash_chan_idle(&d->chan[CRASH_DIR_S2MM])) {
+    crash_dma_set_sts_auto_read(d, false);
+  }
+  crash_chans_unlock(d, flags);
+  crash_mutexes_unlock(d);
+
+  if (thread) kthread_stop(thread);
+  dev_info(&d->pdev->dev, "crash_lease_stop(): Released %s channel\n", dir == CRASH_DIR_S2MM ? "S2MM" : "MM2S");
+  return 0;
+}
+
+static int crash_open_dev(struct crash_dev_drvdata *d, struct file *filp)
+{
+  struct crash_private_data *pd = kzalloc(sizeof(struct crash_private_data), GFP_KERNEL);
+  int dir, tdest;
+
+  if (pd == 0)
+  {
+    dev_err(&d->pdev->dev, "crash_open(): Error allocating crash_private_data\n");
+    return -ENOMEM;
+  }
+
+  // Set reference to global device data
+  pd->d = d;
+
+  if (kfifo_alloc(&pd->evq, CRASH_EVENT_QUEUE_LEN, GFP_KERNEL)) {
+    kfree(pd);
+    dev_err(&d->pdev->dev, "crash_open(): Error allocating event queue\n");
+    return -ENOMEM;
+  }
+  spin_lock_init(&pd->evq_lock);
+  INIT_KFIFO(pd->thq);
+  INIT_LIST_HEAD(&pd->thresh_node);
+  mutex_init(&pd->evq_mutex);
+  init_waitqueue_head(&pd->evq_wait);
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    for (tdest = 0; tdest < CRASH_NUM_TDEST; tdest++) {
+      INIT_LIST_HEAD(&pd->flows[dir][tdest].node);
+      INIT_LIST_HEAD(&pd->flows[dir][tdest].reqs);
+    }
+  }
+  pd->sched.prio = CRASH_SCHED_PRIO_DEFAULT;
+  pd->sched.weight = 1;
+
+  pd->poll.spin_max_bytes = poll_spin_max_bytes;
+  pd->poll.spin_us = min(poll_spin_us, poll_spin_max_us);
+  pd->poll.sleep_min_us = poll_sleep_min_us;
+  pd->poll.sleep_max_us = poll_sleep_max_us;
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    pd->stream_cfg[dir].dir = dir;
+    pd->stream_cfg[dir].nslots = stream_slots;
+    pd->stream_cfg[dir].slot_size = stream_slot_size;
+    pd->stream_cfg[dir].cmd_data = (stream_slot_size << DMA_S2MM_CMD_SIZE_OFFSET) | (1U << DMA_S2MM_CMD_EN_OFFSET);
+    mutex_init(&pd->stream_mutex[dir]);
+  }
+
+  // The DMA buffer is attached on first use, see crash_buffs_attach()
+  init_rwsem(&pd->buffs_sem);
+  atomic_set(&pd->buff_maps, 0);
+
+  // Save to private data to keep track of DMA buffer
+  filp->private_data = pd;
+
+  return 0;
+}
+
+static int crash_open(struct inode *i, struct file *filp)
+{
+  return crash_open_dev(container_of(filp->private_data, struct crash_dev_drvdata, mdev), filp);
+}
+
+static int crash_close(struct inode *i, struct file *filp)
+{
+  struct crash_private_data *pd = filp->private_data;
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_dma_req *req, *tmp;
+  unsigned long timeout = jiffies + msecs_to_jiffies(INTERRUPT_TIMEOUT_MSEC);
+  unsigned long flags;
+  int dir, tdest;
+
+  crash_events_subscribe(pd, &pd->thresh_sub, false);
+  crash_events_subscribe(pd, &pd->fifo_sub, false);
+  crash_trigs_remove(d, pd);
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    if (!pd->lease[dir]) continue;
+    if (d->chan[dir].lease == pd->lease[dir]) crash_lease_stop(pd, dir);
+    crash_lease_free(pd->lease[dir]);
+  }
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    if (!pd->ring[dir]) continue;
+    if (d->chan[dir].ring == pd->ring[dir]) crash_ring_stop(pd, dir);
+    crash_ring_free(&d->pdev->dev, pd->ring[dir]);
+  }
+
+  // Cancel our DMAs that have not started and let the ones in the command FIFO finish
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    spin_lock_irqsave(&d->chan[dir].lock, flags);
+    for (tdest = 0; tdest < CRASH_NUM_TDEST; tdest++) {
+      list_for_each_entry_safe(req, tmp, &pd->flows[dir][tdest].reqs, list) {
+        crash_sched_dequeue(&d->chan[dir], req);
+        crash_dma_req_complete(d, req, 0, -ECANCELED);
+      }
+    }
+    spin_unlock_irqrestore(&d->chan[dir].lock, flags);
+  }
+  while (crash_outstanding(pd)) {
+    crash_service_all(d);
+    if (time_after(jiffies, timeout)) {
+      dev_err(&d->pdev->dev, "crash_close(): DMA timeout, stopping transfers\n");
+      crash_chans_lock(d, &flags);
+      for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+        if (d->chan[dir].ring || d->chan[dir].lease || !d->chan[dir].inflight_cnt) continue;
+        atomic64_inc(&d->chan[dir].stats.timeouts);
+        crash_chan_abort(d, dir, NULL, -ECANCELED);
+      }
+      crash_chans_unlock(d, flags);
+      crash_trigs_dma(d);
+      break;
+    }
+    wait_event_timeout(pd->evq_wait, crash_outstanding(pd) == 0, 1);
+  }
+
+  // For safeties sake, stop all transfers. Leave directions other file descriptors are using alone.
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    spin_lock_irqsave(&d->chan[dir].lock, flags);
+    if (crash_chan_idle(&d->chan[dir])) {
+      crash_dma_xfer_en(d, dir, false);
+      d->chan[dir].xfer_en = false;
+    }
+    spin_unlock_irqrestore(&d->chan[dir].lock, flags);
+  }
+
+  crash_buffs_free(pd);
+  crash_user_buffs_free(pd);
+  kfifo_free(&pd->evq);
+  kfree(pd);
+  dev_info(&d->pdev->dev, "crash_close(): Freed DMA buffer\n");
+  return 0;
+}
+
+static __poll_t crash_poll(struct file *filp, poll_table *wait)
+{
+  struct crash_private_data *pd = filp->private_data;
+  __poll_t mask = 0;
+
+  poll_wait(filp, &pd->evq_wait, wait);
+  crash_service_all(pd->d);
+  if (crash_events_ready(pd)) mask |= EPOLLIN | EPOLLRDNORM;
+  return mask;
+}
+
+// Read whole struct crash_event records
+static ssize_t crash_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos)
+{
+  struct crash_private_data *pd = filp->private_data;
+  struct crash_dev_drvdata *d = pd->d;
+  unsigned int copied, n;
+  bool irqs;
+  int result;
+
+  if (count < sizeof(struct crash_event)) return -EINVAL;
+  count -= count % sizeof(struct crash_event);
+
+  if (mutex_lock_interruptible(&pd->evq_mutex)) return -ERESTARTSYS;
+  for (;;) {
+    crash_service_all(d);
+    if (crash_events_ready(pd)) break;
+    if (filp->f_flags & O_NONBLOCK) {
+      mutex_unlock(&pd->evq_mutex);
+      return -EAGAIN;
+    }
+    // Without interrupts completions are only retired by polling, so do not sleep for long
+    irqs = crash_dma_irq_enabled(d, CRASH_DIR_MM2S) && crash_dma_irq_enabled(d, CRASH_DIR_S2MM);
+    if (irqs) {
+      result = wait_event_interruptible(pd->evq_wait, crash_events_ready(pd));
+    } else {
+      result = wait_event_interruptible_timeout(pd->evq_wait, crash_events_ready(pd), 1);
+      if (result > 0) result = 0;
+    }
+    if (result < 0) {
+      mutex_unlock(&pd->evq_mutex);
+      return -ERESTARTSYS;
+    }
+  }
+  result = kfifo_to_user(&pd->evq, buf, count, &copied);
+  if (!result && copied < count) {
+    result = kfifo_to_user(&pd->thq, buf + copied, count - copied, &n);
+    copied += n;
+  }
+  mutex_unlock(&pd->evq_mutex);
+  return result ? result : copied;
+}
+
+// The channel semaphores guard installing pd->lease[] and pd->ring[]
+static int crash_mmap_lease(struct crash_private_data *pd, struct vm_area_struct *vma, int dir)
+{
+  struct crash_lease *l;
+  int result = 0;
+
+  if (crash_mutexes_lock(pd->d)) return -EINTR;
+  l = pd->lease[dir];
+  if (!l || vma->vm_end - vma->vm_start > l->len) {
+    result = -EINVAL;
+  } else if (remap_vmalloc_range(vma, l->ctrl, 0)) {
+    result = -EIO;
+  }
+  crash_mutexes_unlock(pd->d);
+  return result;
+}
+
+static int crash_mmap_ring(struct crash_private_data *pd, struct vm_area_struct *vma, int dir)
+{
+  struct crash_ring *r;
+  unsigned long addr = vma->vm_start;
+  unsigned int i;
+  int result = 0;
+
+  if (crash_mutexes_lock(pd->d)) return -EINTR;
+  r = pd->ring[dir];
+  if (!r || vma->vm_end - vma->vm_start != PAGE_SIZE + (unsigned long)r->nslots * r->slot_size) {
+    result = -EINVAL;
+    goto out;
+  }
+
+  if (remap_pfn_range(vma, addr, virt_to_phys(r->ctrl) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot)) {
+    result = -EIO;
+    goto out;
+  }
+  addr += PAGE_SIZE;
+  for (i = 0; i < r->nslots; i++) {
+    if (remap_pfn_range(vma, addr, page_to_pfn(r->slots[i]), r->slot_size, vma->vm_page_prot)) {
+      result = -EIO;
+      goto out;
+    }
+    addr += r->slot_size;
+  }
+out:
+  crash_mutexes_unlock(pd->d);
+  return result;
+}
+
+// CRASH_REG_BATCH: merge field updates per register and apply them with the channel locks held
+static int crash_reg_batch(struct crash_private_data *pd, struct crash_reg_batch *batch)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_reg_op __user *uops = (struct crash_reg_op __user *)(uintptr_t)batch->ops;
+  struct crash_reg_op *ops;
+  struct crash_reg_cache *cache, *c;
+  unsigned int ncache = 0;
+  unsigned long flags;
+  unsigned int i, j;
+  int result = 0;
+
+  if (batch->count == 0) return 0;
+  if (batch->count > CRASH_REG_BATCH_MAX) return -EINVAL;
+
+  ops = kmalloc_array(batch->count, sizeof(struct crash_reg_op), GFP_KERNEL);
+  cache = kmalloc_array(batch->count, sizeof(struct crash_reg_cache), GFP_KERNEL);
+  if (!ops || !cache) {
+    result = -ENOMEM;
+    goto out;
+  }
+  if (copy_from_user(ops, uops, batch->count * sizeof(struct crash_reg_op))) {
+    result = -EFAULT;
+    goto out;
+  }
+  for (i = 0; i < batch->count; i++) {
+    if (ops[i].bank >= d->regs_len / sizeof(uint32_t)) result = -EINVAL;
+    if (ops[i].bank - DMA_BASE < REGS_ADDR_SIZE) result = -EINVAL;
+    // GLOBAL_RESET resets every bank behind the shadow's back, it goes through CRASH_RESET
+    if (ops[i].bank == GLOBAL_BANK0_BASE) result = -EINVAL;
+    if (ops[i].op != CRASH_REG_OP_READ && ops[i].op != CRASH_REG_OP_WRITE) result = -EINVAL;
+  }
+  if (result) goto out;
+
+  crash_chans_lock(d, &flags);
+  spin_lock(&d->shadow_lock);
+  for (i = 0; i < batch->count; i++) {
+    c = NULL;
+    for (j = 0; j < ncache; j++) {
+      if (cache[j].bank == ops[i].bank) {
+        c = &cache[j];
+        break;
+      }
+    }
+    if (ops[i].op == CRASH_REG_OP_READ) {
+      // Reads see any updates the batch made to the register. Shadowed banks return the shadow,
+      // the others are read from the hardware.
+      if (!c) {
+        c = &cache[ncache++];
+        c->bank = ops[i].bank;
+        c->dirty = false;
+      }
+      crash_reg_flush(d, c);
+      c->value = crash_reg_shadowed(c->bank) ? d->shadow[c->bank] : d->regs[c->bank];
+      ops[i].value = c->value & ops[i].mask;
+    } else {
+      if (!c) {
+        c = &cache[ncache++];
+        c->bank = ops[i].bank;
+        c->dirty = false;
+        // A write of the whole register does not need the old value
+        if (crash_reg_shadowed(c->bank)) {
+          c->value = d->shadow[c->bank];
+        } else {
+          c->value = (ops[i].mask == 0xFFFFFFFF) ? 0 : d->regs[c->bank];
+        }
+      }
+      c->value = (c->value & ~ops[i].mask) | (ops[i].value & ops[i].mask);
+      c->dirty = true;
+    }
+  }
+  for (j = 0; j < ncache; j++) {
+    crash_reg_flush(d, &cache[j]);
+  }
+  spin_unlock(&d->shadow_lock);
+  crash_chans_unlock(d, flags);
+
+  if (copy_to_user(uops, ops, batch->count * sizeof(struct crash_reg_op))) result = -EFAULT;
+out:
+  kfree(cache);
+  kfree(ops);
+  return result;
+}
+
+// CRASH_TRIG_SET: check and copy the writes, then install the list, replacing t->id if given
+static int crash_trig_set(struct crash_private_data *pd, struct crash_trig *t)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_reg_op *ops;
+  struct crash_trig_list *l, *old;
+  unsigned long flags;
+  uint32_t i, id;
+  int result = 0;
+
+  if (t->count == 0 || t->count > CRASH_TRIG_MAX_OPS || t->nsteps == 0 || t->count % t->nsteps) return -EINVAL;
+  if (t->event > CRASH_TRIG_TIMER || (t->flags & ~CRASH_TRIG_ONESHOT)) return -EINVAL;
+  if (t->event == CRASH_TRIG_TIMER && t->period_us < CRASH_TRIG_MIN_PERIOD_US) return -EINVAL;
+  if (t->id != CRASH_TRIG_NEW && t->id >= CRASH_TRIG_MAX) return -EINVAL;
+
+  ops = kmalloc_array(t->count, sizeof(struct crash_reg_op), GFP_KERNEL);
+  l = kzalloc(struct_size(l, writes, t->count), GFP_KERNEL);
+  if (!ops || !l) {
+    result = -ENOMEM;
+    goto err;
+  }
+  if (copy_from_user(ops, (void __user *)(uintptr_t)t->ops, t->count * sizeof(struct crash_reg_op))) {
+    result = -EFAULT;
+    goto err;
+  }
+  for (i = 0; i < t->count; i++) {
+    if (ops[i].bank >= d->regs_len / sizeof(uint32_t)) result = -EINVAL;
+    if (ops[i].bank - DMA_BASE < REGS_ADDR_SIZE) result = -EINVAL;
+    // GLOBAL_RESET resets every bank behind the shadow's back, it goes through CRASH_RESET
+    if (ops[i].bank == GLOBAL_BANK0_BASE) result = -EINVAL;
+    if (ops[i].op != CRASH_REG_OP_WRITE) result = -EINVAL;
+    l->writes[i].bank = ops[i].bank;
+    l->writes[i].mask = ops[i].mask;
+    l->writes[i].value = ops[i].value & ops[i].mask;
+  }
+  if (result) goto err;
+  kfree(ops);
+  ops = NULL;
+
+  l->d = d;
+  l->pd = pd;
+  l->event = t->event;
+  l->every = max_t(uint32_t, t->every, 1);
+  l->flags = t->flags;
+  l->nsteps = t->nsteps;
+  l->step_len = t->count / t->nsteps;
+  l->armed = true;
+  l->period = us_to_ktime(t->period_us);
+  if (l->event == CRASH_TRIG_TIMER) {
+    hrtimer_init(&l->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    l->timer.function = crash_trig_timer;
+  }
+
+  spin_lock_irqsave(&d->trig_lock, flags);
+  if (t->id == CRASH_TRIG_NEW) {
+    for (id = 0; id < CRASH_TRIG_MAX && d->trigs[id]; id++);
+    if (id == CRASH_TRIG_MAX) result = -EBUSY;
+  } else {
+    id = t->id;
+    if (d->trigs[id] && d->trigs[id]->pd != pd) result = -EPERM;
+  }
+  if (result) {
+    spin_unlock_irqrestore(&d->trig_lock, flags);
+    goto err;
+  }
+  old = crash_trig_detach(d, id);
+  l->id = id;
+  if (l->event <= CRASH_TRIG_DMA_S2MM) {
+    // Count completions from now on
+    l->seen = atomic64_read(&d->chan[l->event].stats.transfers);
+    WRITE_ONCE(d->trigs_dma, d->trigs_dma + 1);
+  }
+  d->trigs[id] = l;
+  if (l->event == CRASH_TRIG_TIMER) {
+    hrtimer_start(&l->timer, t->start_ns ? ns_to_ktime(t->start_ns) : ktime_add(ktime_get(), l->period), HRTIMER_MODE_ABS);
+  }
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+
+  if (old) crash_trig_free(old);
+  t->id = id;
+  return 0;
+
+err:
+  kfree(l);
+  kfree(ops);
+  return result;
+}
+
+// CRASH_TRIG_CLEAR
+static int crash_trig_clear(struct crash_private_data *pd, unsigned long id)
+{
+  struct crash_dev_drvdata *d = pd->d;
+  struct crash_trig_list *l = NULL;
+  unsigned long flags;
+
+  if (id >= CRASH_TRIG_MAX) return -EINVAL;
+  spin_lock_irqsave(&d->trig_lock, flags);
+  if (d->trigs[id] && d->trigs[id]->pd == pd) l = crash_trig_detach(d, id);
+  spin_unlock_irqrestore(&d->trig_lock, flags);
+  if (!l) return -EINVAL;
+  crash_trig_free(l);
+  return 0;
+}
+
+// Count mappings of the DMA buffers so they are not replaced while userspace can see them
+static void crash_buff_vm_open(struct vm_area_struct *vma)
+{
+  struct crash_private_data *pd = vma->vm_private_data;
+
+  atomic_inc(&pd->buff_maps);
+}
+
+static void crash_buff_vm_close(struct vm_area_struct *vma)
+{
+  struct crash_private_data *pd = vma->vm_private_data;
+
+  atomic_dec(&pd->buff_maps);
+}
+
+static const struct vm_operations_struct crash_buff_vm_ops = {
+  .open = crash_buff_vm_open,
+  .close = crash_buff_vm_close,
+};
+
+static int crash_mmap_buff(struct crash_private_data *pd, struct vm_area_struct *vma, unsigned int buff)
+{
+  unsigned long len = vma->vm_end - vma->vm_start;
+  int result = 0;
+
+  struct crash_buff *b;
+
+  if (crash_buffs_attach(pd)) return -ENOMEM;
+  down_read(&pd->buffs_sem);
+  b = &pd->buffs[buff];
+  if (buff >= pd->nbuffs || len > b->len) {
+    result = -EINVAL;
+  } else if (b->mode == CRASH_BUFF_STREAMING) {
+    // Cached mapping, coherency is managed with CRASH_SYNC_FOR_CPU / CRASH_SYNC_FOR_DEVICE
+    if (remap_pfn_range(vma, vma->vm_start, page_to_pfn(b->pages), len, vma->vm_page_prot)) result = -EIO;
+  } else {
+    // dma_mmap_coherent() takes vm_pgoff as the offset into the buffer
+    vma->vm_pgoff = 0;
+    if (dma_mmap_coherent(&pd->d->pdev->dev, vma, b->cpu_addr, b->dma_addr, len)) result = -EIO;
+  }
+  if (!result) {
+    vma->vm_private_data = pd;
+    vma->vm_ops = &crash_buff_vm_ops;
+    crash_buff_vm_open(vma);
+  }
+  up_read(&pd->buffs_sem);
+  return result;
+}
+
+static int crash_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  struct crash_private_data *pd = filp->private_data;
+  unsigned long mmap_type = vma->vm_pgoff << PAGE_SHIFT;
+  int result;
+
+  if (mmap_type == MMAP_REGS) {
+    if (vma)
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    if (remap_pfn_range(vma, vma->vm_start, pd->d->regs_phys_addr >> PAGE_SHIFT, pd->d->regs_len, vma->vm_page_prot)) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap control registers\n");
+      return -EIO;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped control registers\n");
+    return 0;
+  } else if (mmap_type == MMAP_REGS_SHADOW) {
+    // Read only, the shadow must only change along with the registers
+    if (vma->vm_flags & VM_WRITE) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Shadow registers are read only\n");
+      return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+    if (vma->vm_end - vma->vm_start > REGS_TOTAL_ADDR_SPACE || remap_vmalloc_range(vma, pd->d->shadow, 0)) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap shadow registers\n");
+      return -EIO;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped shadow registers\n");
+    return 0;
+  } else if (mmap_type == MMAP_STATUS) {
+    if (vma->vm_flags & VM_WRITE) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Status page is read only\n");
+      return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+    if (vma->vm_end - vma->vm_start > PAGE_SIZE || remap_vmalloc_range(vma, pd->d->status, 0)) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap status page\n");
+      return -EIO;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped status page\n");
+    return 0;
+  } else if (mmap_type == MMAP_LEASE_MM2S || mmap_type == MMAP_LEASE_S2MM) {
+    result = crash_mmap_lease(pd, vma, mmap_type == MMAP_LEASE_S2MM ? CRASH_DIR_S2MM : CRASH_DIR_MM2S);
+    if (result) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap exclusive channel queues\n");
+      return result;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped exclusive channel queues\n");
+    return 0;
+  } else if (mmap_type >= MMAP_DMA_BUFF && mmap_type < MMAP_DMA_BUFF_IDX(CRASH_MAX_BUFFS)) {
+    result = crash_mmap_buff(pd, vma, (mmap_type - MMAP_DMA_BUFF) / 0x1000);
+    if (result) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap DMA buffer\n");
+      return result;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped DMA buffer\n");
+    return 0;
+  } else if (mmap_type == MMAP_RING_MM2S || mmap_type == MMAP_RING_S2MM) {
+    result = crash_mmap_ring(pd, vma, mmap_type == MMAP_RING_S2MM ? CRASH_DIR_S2MM : CRASH_DIR_MM2S);
+    if (result) {
+      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap DMA ring\n");
+      return result;
+    }
+    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped DMA ring\n");
+    return 0;
+  }
+  dev_err(&pd->d->pdev->dev, "crash_mmap(): Invalid offset\n");
+  return -EINVAL;
+}
+
+static long crash_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+  struct crash_private_data *pd = filp->private_data;
+  struct crash_dma_chan *mm2s = &pd->d->chan[CRASH_DIR_MM2S];
+  struct crash_dma_chan *s2mm = &pd->d->chan[CRASH_DIR_S2MM];
+  struct crash_ring_config ring_cfg;
+  struct crash_lease_config lease_cfg;
+  struct crash_dma_xfer xfer;
+  struct crash_poll_policy poll;
+  struct crash_buff_alloc buff_alloc;
+  struct crash_buff_sync buff_sync;
+  struct crash_buff_register buff_reg;
+  struct crash_reg_batch reg_batch;
+  struct crash_trig trig;
+  struct crash_sched sched;
+  uint32_t dma_phys_addr;
+  struct crash_ring *r;
+  struct crash_lease *l;
+  unsigned long flags;
+  uint32_t buff;
+  long result;
+  int dir;
+
+  switch (cmd) {
+    case CRASH_RESET:
+      // Grab mutexes so we do not reset in the middle of a DMA
+      if (crash_mutexes_lock(pd->d)) return -EINTR;
+      crash_chans_lock(pd->d, &flags);
+      // Resetting would lose queued DMAs and leave a streaming ring without its commands
+      if (!crash_chan_idle(mm2s) || !crash_chan_idle(s2mm)) {
+        crash_chans_unlock(pd->d, flags);
+        crash_mutexes_unlock(pd->d);
+        return -EBUSY;
+      }
+      crash_shadow_set_bit(pd->d, GLOBAL_RESET);
+      crash_shadow_clear_bit(pd->d, GLOBAL_RESET);
+      // The reset puts the other banks back to their defaults
+      crash_shadow_load(pd->d);
+      // Set CACHE bits that affects whether AXI ACP transfers are cached or not.
+      // This should not be changed unless you know what you are doing.
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_AWPROT,  0x00);      //  AWPROT: "000"
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_AWCACHE, 0x0F);      // AWCACHE: "1111"
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_AWUSER,  0x1F);      //  AWUSER: "11111"
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_ARPROT,  0x00);      //  ARPROT: "000"
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_ARCACHE, 0x0F);      // ARCACHE: "1111"
+      crash_shadow_write_reg(pd->d, GLOBAL_M_AXI_ARUSER,  0x1F);      //  ARUSER: "11111"
+      crash_dma_set_sts_auto_read(pd->d, false);
+      mm2s->xfer_en = false;
+      s2mm->xfer_en = false;
+      crash_chans_unlock(pd->d, flags);
+      crash_mutexes_unlock(pd->d);
+      break;
+
+    case CRASH_SET_INTERRUPTS:
+      // Grab mutexes so we do not change interrupt configuration in the middle of a DMA
+      if (crash_mutexes_lock(pd->d)) return -EINTR;
+      crash_chans_lock(pd->d, &flags);
+      // Streaming rings depend on their interrupt
+      if (mm2s->ring || s2mm->ring) {
+        crash_chans_unlock(pd->d, flags);
+        crash_mutexes_unlock(pd->d);
+        return -EBUSY;
+      }
+      crash_shadow_write_reg(pd->d, DMA_BANK1, arg);
+      // Exclusive channel threads poll for completions only while the interrupt is off
+      for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+        if (pd->d->chan[dir].lease) wake_up(&pd->d->chan[dir].lease->wait);
+      }
+      crash_chans_unlock(pd->d, flags);
+      crash_mutexes_unlock(pd->d);
+      break;
+
+    case CRASH_GET_INTERRUPTS:
+      // Same bank CRASH_SET_INTERRUPTS writes, from the shadow rather than over the bus
+      buff = crash_read_reg_shadow(pd->d->shadow, DMA_BANK1);
+      if(copy_to_user((uint32_t *)arg,&buff,sizeof(uint32_t))) return -EFAULT;
+      break;
+
+    case CRASH_GET_DMA_PHYS_ADDR:
+      if (crash_buffs_attach(pd)) return -ENOMEM;
+      dma_phys_addr = (uint32_t)pd->buffs[0].dma_addr;
+      if(copy_to_user((uint32_t *)arg,&dma_phys_addr,sizeof(uint32_t))) return -EFAULT;
+      break;
+
+    case CRASH_DMA_WRITE:
+      return crash_dma_xfer_legacy(pd, CRASH_DIR_MM2S, arg);
+
+    case CRASH_DMA_READ:
+      return crash_dma_xfer_legacy(pd, CRASH_DIR_S2MM, arg);
+
+    case CRASH_DMA_XFER:
+      if (copy_from_user(&xfer, (void __user *)arg, sizeof(struct crash_dma_xfer))) return -EFAULT;
+      result = crash_dma_xfer(pd, &xfer);
+      if (copy_to_user((void __user *)arg, &xfer, sizeof(struct crash_dma_xfer))) return -EFAULT;
+      return result;
+
+    case CRASH_ALLOC_BUFFS:
+      if (copy_from_user(&buff_alloc, (void __user *)arg, sizeof(struct crash_buff_alloc))) return -EFAULT;
+      result = crash_alloc_buffs(pd, &buff_alloc);
+      if (result) return result;
+      if (copy_to_user((void __user *)arg, &buff_alloc, sizeof(struct crash_buff_alloc))) return -EFAULT;
+      break;
+
+    case CRASH_SYNC_FOR_CPU:
+    case CRASH_SYNC_FOR_DEVICE:
+      if (copy_from_user(&buff_sync, (void __user *)arg, sizeof(struct crash_buff_sync))) return -EFAULT;
+      return crash_buff_sync(pd, &buff_sync, cmd == CRASH_SYNC_FOR_CPU);
+
+    case CRASH_REGISTER_BUFF:
+      if (copy_from_user(&buff_reg, (void __user *)arg, sizeof(struct crash_buff_register))) return -EFAULT;
+      result = crash_register_buff(pd, &buff_reg, false, 0);
+      if (result) return result;
+      if (copy_to_user((void __user *)arg, &buff_reg, sizeof(struct crash_buff_register))) return -EFAULT;
+      break;
+
+    case CRASH_UNREGISTER_BUFF:
+      return crash_register_buff(pd, NULL, true, (uint32_t)arg);
+
+    case CRASH_REG_BATCH:
+      if (copy_from_user(&reg_batch, (void __user *)arg, sizeof(struct crash_reg_batch))) return -EFAULT;
+      return crash_reg_batch(pd, &reg_batch);
+
+    case CRASH_TRIG_SET:
+      if (copy_from_user(&trig, (void __user *)arg, sizeof(struct crash_trig))) return -EFAULT;
+      result = crash_trig_set(pd, &trig);
+      if (result) return result;
+      if (copy_to_user((void __user *)arg, &trig, sizeof(struct crash_trig))) return -EFAULT;
+      break;
+
+    case CRASH_TRIG_CLEAR:
+      return crash_trig_clear(pd, arg);
+
+    case CRASH_SET_SCHED:
+      if (copy_from_user(&sched, (void __user *)arg, sizeof(struct crash_sched))) return -EFAULT;
+      if (sched.prio >= CRASH_SCHED_PRIOS || sched.weight == 0 || sched.weight > CRASH_SCHED_MAX_WEIGHT) return -EINVAL;
+      crash_chans_lock(pd->d, &flags);
+      pd->sched = sched;
+      crash_chans_unlock(pd->d, flags);
+      break;
+
+    case CRASH_FIFO_EVENTS:
+      crash_events_subscribe(pd, &pd->fifo_sub, arg != 0);
+      break;
+
+    case CRASH_THRESH_EVENTS:
+      crash_events_subscribe(pd, &pd->thresh_sub, arg != 0);
+      break;
+
+    case CRASH_SET_POLL_POLICY:
+      if (copy_from_user(&poll, (void __user *)arg, sizeof(struct crash_poll_policy))) return -EFAULT;
+      if (poll.sleep_min_us == 0 || poll.sleep_max_us < poll.sleep_min_us) return -EINVAL;
+      if (poll.spin_us > READ_ONCE(poll_spin_max_us)) return -EINVAL;
+      pd->poll = poll;
+      break;
+
+    case CRASH_DMA_SUBMIT:
+      return crash_dma_submit(pd, (struct crash_dma_submit __user *)arg);
+
+    case CRASH_RING_START:
+      if (copy_from_user(&ring_cfg, (void __user *)arg, sizeof(struct crash_ring_config))) return -EFAULT;
+      if (ring_cfg.dir >= CRASH_NUM_DIRS) return -EINVAL;
+      return crash_ring_start(pd, &ring_cfg);
+
+    case CRASH_RING_STOP:
+      if (arg >= CRASH_NUM_DIRS) return -EINVAL;
+      return crash_ring_stop(pd, arg);
+
+    case CRASH_RING_KICK:
+    case CRASH_RING_WAIT:
+      if (arg >= CRASH_NUM_DIRS) return -EINVAL;
+      r = pd->ring[arg];
+      if (!r || pd->d->chan[arg].ring != r) return -EINVAL;
+      spin_lock_irqsave(&pd->d->chan[arg].lock, flags);
+      crash_ring_service(pd->d, r);
+      spin_unlock_irqrestore(&pd->d->chan[arg].lock, flags);
+      crash_trigs_dma(pd->d);
+      if (cmd == CRASH_RING_KICK) break;
+      result = wait_event_interruptible_timeout(pd->d->chan[arg].ring_wait, crash_ring_ready(&pd->d->chan[arg], r), msecs_to_jiffies(INTERRUPT_TIMEOUT_MSEC));
+      if (result < 0) return result;
+      if (result == 0) return -ETIMEDOUT;
+      if (pd->d->chan[arg].ring != r) return -EPIPE;
+      break;
+
+    case CRASH_CHAN_LEASE:
+      if (copy_from_user(&lease_cfg, (void __user *)arg, sizeof(struct crash_lease_config))) return -EFAULT;
+      if (lease_cfg.dir >= CRASH_NUM_DIRS) return -EINVAL;
+      result = crash_lease_start(pd, &lease_cfg);
+      if (result) return result;
+      if (copy_to_user((void __user *)arg, &lease_cfg, sizeof(struct crash_lease_config))) return -EFAULT;
+      break;
+
+    case CRASH_CHAN_RELEASE:
+      if (arg >= CRASH_NUM_DIRS) return -EINVAL;
+      return crash_lease_stop(pd, arg);
+
+    case CRASH_CHAN_WAKE:
+      if (arg >= CRASH_NUM_DIRS) return -EINVAL;
+      l = pd->lease[arg];
+      if (!l || pd->d->chan[arg].lease != l) return -EINVAL;
+      wake_up(&l->wait);
+      break;
+
+    default:
+      return -EFAULT;
+  }
+  return 0;
+}
+
+// Retire completed DMAs and queue the next ones on every direction that has a completion waiting
+static unsigned int crash_irq_service(struct crash_dev_drvdata *d)
+{
+  struct crash_dma_chan *chan;
+  unsigned int pending, serviced = 0;
+  unsigned long flags;
+  int dir;
+
+  pending = crash_dma_sts_pending(d);
+  trace_crash_irq(pending);
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    if (!(pending & (1 << dir))) continue;
+    chan = &d->chan[dir];
+    spin_lock_irqsave(&chan->lock, flags);
+    if (chan->ring) {
+      serviced += crash_ring_service(d, chan->ring);
+    } else if (chan->lease) {
+      serviced += crash_lease_service(d, chan->lease);
+    } else {
+      serviced += crash_chan_service(d, dir);
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+  }
+  crash_trigs_dma(d);
+  serviced += crash_thresh_service(d);
+  // Like the lease thread, leave refreshes with nothing new to the monitor timer
+  if (serviced) crash_status_update(d);
+  return serviced;
+}
+
+static irqreturn_t crash_irq_handler(int irq, void *pdata)
+{
+  struct crash_dev_drvdata *d = pdata;
+
+  atomic64_inc(&d->irqs);
+  if (!crash_irq_service(d)) {
+    atomic64_inc(&d->errant_irqs);
+    dev_err(&d->pdev->dev, "crash_irq_handler(): Received errant interrupt\n");
+  }
+  return IRQ_HANDLED;
+}
+
+// With irq_threaded the interrupt line stays masked until this returns (IRQF_ONESHOT). While
+// completions keep arriving keep polling instead of taking an interrupt for each of them, and
+// unmask once a poll finds nothing or the budget runs out.
+static irqreturn_t crash_irq_thread(int irq, void *pdata)
+{
+  struct crash_dev_drvdata *d = pdata;
+  unsigned int rounds = 0, serviced, total = 0;
+
+  atomic64_inc(&d->irqs);
+  for (;;) {
+    serviced = crash_irq_service(d);
+    total += serviced;
+    if (!serviced || ++rounds >= irq_poll_budget) break;
+    usleep_range(irq_poll_us, irq_poll_us + irq_poll_us / 2 + 1);
+  }
+
+  if (!total) {
+    atomic64_inc(&d->errant_irqs);
+    dev_err(&d->pdev->dev, "crash_irq_thread(): Received errant interrupt\n");
+  }
+  return IRQ_HANDLED;
+}
+
 /*
- * Local data for each file descriptor
- * Used to hold information about DMA buffer
+ * Statistics: counters in sysfs (/sys/class/misc/crashN/stats), latency histograms in debugfs
  */
-struct crash_private_data {
-  struct crash_dev_drvdata  *d;                   // Pointer to device data
-  struct page               *dma_buff;            // DMA buffer
-  uint32_t                  dma_phys_addr;        // Physical address of DMA buffer
-  size_t                    dma_buff_len;         // Length of DMA buffer
-};
+static struct crash_dev_drvdata *crash_dev_from_dev(struct device *dev)
+{
+  struct miscdevice *mdev = dev_get_drvdata(dev);
 
-static const struct of_device_id crash_of_ids[] = {
-  { .compatible = "crash" },
-  { }
+  return container_of(mdev, struct crash_dev_drvdata, mdev);
+}
+
+struct crash_stat_attr {
+  struct device_attribute   attr;
+  int                       dir;
+  size_t                    offset;         // Offset of the counter in struct crash_dma_stats
 };
 
-static int crash_open(struct inode *i, struct file *filp)
+static ssize_t crash_stat_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-  struct crash_dev_drvdata *d = container_of(filp->private_data, struct crash_dev_drvdata, mdev);
-  struct crash_private_data *pd = kmalloc(sizeof(struct crash_private_data), GFP_KERNEL);
+  struct crash_dev_drvdata *d = crash_dev_from_dev(dev);
+  struct crash_stat_attr *sa = container_of(attr, struct crash_stat_attr, attr);
+  atomic64_t *counter = (atomic64_t *)((char *)&d->chan[sa->dir].stats + sa->offset);
 
-  // Set reference to global device data
-  pd->d = d;
+  return sprintf(buf, "%lld\n", (long long)atomic64_read(counter));
+}
 
-  if (pd == 0)
-  {
-    dev_err(&d->pdev->dev, "crash_open(): Error allocating crash_private_data\n");
-    return -ENOMEM;
-  }
+#define CRASH_STAT_ATTR(_dirname, _dir, _field) \
+  static struct crash_stat_attr crash_stat_##_dirname##_##_field = { \
+    __ATTR(_dirname##_##_field, 0444, crash_stat_show, NULL), _dir, offsetof(struct crash_dma_stats, _field) }
 
-  pd->dma_buff = alloc_pages(GFP_KERNEL, PAGE_ORDER);
-  if (!pd->dma_buff) {
-    kfree(pd);
-    dev_err(&d->pdev->dev, "crash_open(): Error allocating DMA buffer\n");
-    return -ENOMEM;
-  }
-  pd->dma_phys_addr = (uint32_t)page_to_phys(pd->dma_buff);
-  pd->dma_buff_len = (1 << PAGE_ORDER) * PAGE_SIZE;
-  dev_info(&d->pdev->dev, "crash_open(): Allocated DMA buffer\n");
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, transfers);
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, bytes);
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, errors);
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, timeouts);
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, mutex_wait_ns);
+CRASH_STAT_ATTR(mm2s, CRASH_DIR_MM2S, fifo_errors);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, transfers);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, bytes);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, errors);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, timeouts);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, mutex_wait_ns);
+CRASH_STAT_ATTR(s2mm, CRASH_DIR_S2MM, fifo_errors);
 
-  // Save to private data to keep track of DMA buffer
-  filp->private_data = pd;
+// Hardware counters, to compare against the software ones
+static ssize_t mm2s_hw_xfer_cnt_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%u\n", crash_dma_xfer_cnt(crash_dev_from_dev(dev), CRASH_DIR_MM2S));
+}
+static DEVICE_ATTR_RO(mm2s_hw_xfer_cnt);
 
-  return 0;
+static ssize_t s2mm_hw_xfer_cnt_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%u\n", crash_dma_xfer_cnt(crash_dev_from_dev(dev), CRASH_DIR_S2MM));
 }
+static DEVICE_ATTR_RO(s2mm_hw_xfer_cnt);
 
-static int crash_close(struct inode *i, struct file *filp)
+static ssize_t hw_debug_cnt_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-  struct crash_private_data *pd = filp->private_data;
+  volatile uint32_t *regs = crash_dev_from_dev(dev)->regs;
 
-  // For safeties sake, stop all transfers
-  crash_clear_bit(pd->d->regs, DMA_MM2S_XFER_EN);
-  crash_clear_bit(pd->d->regs, DMA_S2MM_XFER_EN);
+  return sprintf(buf, "%u\n", (uint32_t)crash_read_reg(regs, DMA_DEBUG_CNT));
+}
+static DEVICE_ATTR_RO(hw_debug_cnt);
 
-  __free_pages(pd->dma_buff, PAGE_ORDER);
-  kfree(pd);
-  dev_info(&pd->d->pdev->dev, "crash_close(): Freed DMA buffer\n");
-  return 0;
+static ssize_t irqs_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%lld\n", (long long)atomic64_read(&crash_dev_from_dev(dev)->irqs));
 }
+static DEVICE_ATTR_RO(irqs);
 
-static int crash_mmap(struct file *filp, struct vm_area_struct *vma)
+static ssize_t errant_irqs_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-  struct crash_private_data *pd = filp->private_data;
-  unsigned long mmap_type = vma->vm_pgoff << PAGE_SHIFT;
+  return sprintf(buf, "%lld\n", (long long)atomic64_read(&crash_dev_from_dev(dev)->errant_irqs));
+}
+static DEVICE_ATTR_RO(errant_irqs);
 
-  if (mmap_type == MMAP_REGS) {
-    if (vma)
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-    if (remap_pfn_range(vma, vma->vm_start, pd->d->regs_phys_addr >> PAGE_SHIFT, pd->d->regs_len, vma->vm_page_prot)) {
-      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap control registers\n");
-      return -EIO;
-    }
-    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped control registers\n");
-    return 0;
-  } else if (mmap_type == MMAP_DMA_BUFF) {
-    if (remap_pfn_range(vma, vma->vm_start, page_to_pfn(pd->dma_buff), pd->dma_buff_len, vma->vm_page_prot)) {
-      dev_err(&pd->d->pdev->dev, "crash_mmap(): Failed to mmap DMA buffer\n");
-      return -EIO;
+// Writing anything clears the software counters and histograms
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+  struct crash_dev_drvdata *d = crash_dev_from_dev(dev);
+  struct crash_dma_stats *st;
+  int dir, i;
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    st = &d->chan[dir].stats;
+    atomic64_set(&st->transfers, 0);
+    atomic64_set(&st->bytes, 0);
+    atomic64_set(&st->errors, 0);
+    atomic64_set(&st->timeouts, 0);
+    atomic64_set(&st->mutex_wait_ns, 0);
+    atomic64_set(&st->fifo_errors, 0);
+    for (i = 0; i < CRASH_LAT_BUCKETS; i++) {
+      atomic64_set(&st->lat_hist[i], 0);
     }
-    dev_info(&pd->d->pdev->dev, "crash_mmap(): Memory Mapped DMA buffer\n");
-    return 0;
   }
-  dev_err(&pd->d->pdev->dev, "crash_mmap(): Invalid offset\n");
-  return -EINVAL;
+  atomic64_set(&d->irqs, 0);
+  atomic64_set(&d->errant_irqs, 0);
+  return count;
 }
+static DEVICE_ATTR_WO(reset);
 
-static long crash_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+static struct attribute *crash_stats_attrs[] = {
+  &crash_stat_mm2s_transfers.attr.attr,
+  &crash_stat_mm2s_bytes.attr.attr,
+  &crash_stat_mm2s_errors.attr.attr,
+  &crash_stat_mm2s_timeouts.attr.attr,
+  &crash_stat_mm2s_mutex_wait_ns.attr.attr,
+  &crash_stat_mm2s_fifo_errors.attr.attr,
+  &crash_stat_s2mm_transfers.attr.attr,
+  &crash_stat_s2mm_bytes.attr.attr,
+  &crash_stat_s2mm_errors.attr.attr,
+  &crash_stat_s2mm_timeouts.attr.attr,
+  &crash_stat_s2mm_mutex_wait_ns.attr.attr,
+  &crash_stat_s2mm_fifo_errors.attr.attr,
+  &dev_attr_mm2s_hw_xfer_cnt.attr,
+  &dev_attr_s2mm_hw_xfer_cnt.attr,
+  &dev_attr_hw_debug_cnt.attr,
+  &dev_attr_irqs.attr,
+  &dev_attr_errant_irqs.attr,
+  &dev_attr_reset.attr,
+  NULL,
+};
 
-  struct crash_private_data *pd = filp->private_data;
-  volatile uint32_t *regs = pd->d->regs;
-  unsigned int i = 0;
-  unsigned int j = 0;
-  uint32_t buff;
+static const struct attribute_group crash_stats_group = {
+  .name = "stats",
+  .attrs = crash_stats_attrs,
+};
 
-  switch (cmd) {
-    case CRASH_RESET:
-      // Grab mutexes so we do not reset in the middle of a DMA
-      if (mutex_lock_interruptible(&pd->d->mm2s_mutex)) return -EINTR;
-      if (mutex_lock_interruptible(&pd->d->s2mm_mutex)) {
-        mutex_unlock(&pd->d->mm2s_mutex);
-        return -EINTR;
-      }
-      crash_set_bit(regs, GLOBAL_RESET);
-      crash_clear_bit(regs, GLOBAL_RESET);
-      // Set CACHE bits that affects whether AXI ACP transfers are cached or not.
-      // This should not be changed unless you know what you are doing.
-      crash_write_reg(regs, GLOBAL_M_AXI_AWPROT,  0x00);      //  AWPROT: "000"
-      crash_write_reg(regs, GLOBAL_M_AXI_AWCACHE, 0x0F);      // AWCACHE: "1111"
-      crash_write_reg(regs, GLOBAL_M_AXI_AWUSER,  0x1F);      //  AWUSER: "11111"
-      crash_write_reg(regs, GLOBAL_M_AXI_ARPROT,  0x00);      //  ARPROT: "000"
-      crash_write_reg(regs, GLOBAL_M_AXI_ARCACHE, 0x0F);      // ARCACHE: "1111"
-      crash_write_reg(regs, GLOBAL_M_AXI_ARUSER,  0x1F);      //  ARUSER: "11111"
-      mutex_unlock(&pd->d->mm2s_mutex);
-      mutex_unlock(&pd->d->s2mm_mutex);
-      break;
+/*
+ * Instance topology: /sys/class/misc/crashN/{instance,irq,regs_addr,regs_len,of_node}, and the
+ * device link to the platform device. Pin an instance's interrupt with /proc/irq/<irq>/smp_affinity.
+ */
+static ssize_t instance_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%d\n", crash_dev_from_dev(dev)->id);
+}
+static DEVICE_ATTR_RO(instance);
 
-    case CRASH_SET_INTERRUPTS:
-      // Grab mutexes so we do not change interrupt configuration in the middle of a DMA
-      if (mutex_lock_interruptible(&pd->d->mm2s_mutex)) return -EINTR;
-      if (mutex_lock_interruptible(&pd->d->s2mm_mutex)) {
-        mutex_unlock(&pd->d->mm2s_mutex);
-        return -EINTR;
-      }
-      crash_write_reg(regs, DMA_BANK1, arg);
-      mutex_unlock(&pd->d->mm2s_mutex);
-      mutex_unlock(&pd->d->s2mm_mutex);
-      break;
+static ssize_t irq_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%u\n", crash_dev_from_dev(dev)->irq);
+}
+static DEVICE_ATTR_RO(irq);
 
-    case CRASH_GET_INTERRUPTS:
-      buff = crash_read_reg(regs, DMA_BANK0);
-      if(copy_to_user((uint32_t *)arg,&buff,sizeof(uint32_t))) return -EFAULT;
-      break;
+static ssize_t regs_addr_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "0x%08x\n", crash_dev_from_dev(dev)->regs_phys_addr);
+}
+static DEVICE_ATTR_RO(regs_addr);
 
-    case CRASH_GET_DMA_PHYS_ADDR:
-      if(copy_to_user((uint32_t *)arg,&pd->dma_phys_addr,sizeof(uint32_t))) return -EFAULT;
-      break;
+static ssize_t regs_len_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%zu\n", crash_dev_from_dev(dev)->regs_len);
+}
+static DEVICE_ATTR_RO(regs_len);
 
-    case CRASH_DMA_WRITE:
-      if (mutex_lock_interruptible(&pd->d->mm2s_mutex)) return -EINTR;
-      crash_write_reg(regs, DMA_MM2S_CMD_ADDR, pd->dma_phys_addr);
-      crash_write_reg(regs, DMA_MM2S_CMD_DATA, arg);
-      crash_set_bit(regs, DMA_MM2S_XFER_EN);
-      // Check if transfer interrupt is enabled.
-      if (crash_get_bit(regs, DMA_MM2S_INTERRUPT)) {
-        if (wait_event_interruptible_timeout(pd->d->irq_mm2s_wait, atomic_read(&pd->d->irq_mm2s) > 0, msecs_to_jiffies(INTERRUPT_TIMEOUT_MSEC)) == 0) {
-          dev_err(&pd->d->pdev->dev, "crash_ioctl(): DMA timeout (Interrupt)\n");
-          crash_clear_bit(regs, DMA_MM2S_XFER_EN);
-          mutex_unlock(&pd->d->mm2s_mutex);
-          return -ETIMEDOUT;
-        }
-        atomic_dec(&pd->d->irq_mm2s);
-      } else {
-        // Poll until DMA is complete or we timeout.
-        // TODO: Use something less hackish than a counter for the timeout code
-        i = 0;
-        while(crash_get_bit(regs, DMA_MM2S_STS_FIFO_EMPTY)) {
-          if (i > 1000000) {
-            dev_err(&pd->d->pdev->dev, "crash_ioctl(): DMA timeout (Polling)\n");
-            crash_clear_bit(regs, DMA_MM2S_XFER_EN);
-            mutex_unlock(&pd->d->mm2s_mutex);
-            return -ETIMEDOUT;
-          }
-          i++;
-        }
-      }
-      // Dummy read on status register, which causes it to read the FIFO (and therefore return the FIFO to the empty state)
-      i = crash_read_reg(regs, DMA_MM2S_STS_FIFO);
-      crash_clear_bit(regs, DMA_MM2S_XFER_EN);
-      mutex_unlock(&pd->d->mm2s_mutex);
-      break;
+static ssize_t of_node_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+  return sprintf(buf, "%pOF\n", crash_dev_from_dev(dev)->pdev->dev.of_node);
+}
+static DEVICE_ATTR_RO(of_node);
 
-    case CRASH_DMA_READ:
-      if (mutex_lock_interruptible(&pd->d->s2mm_mutex)) return -EINTR;
-      crash_write_reg(regs, DMA_S2MM_CMD_ADDR, pd->dma_phys_addr);
-      crash_write_reg(regs, DMA_S2MM_CMD_DATA, arg);
-      crash_set_bit(regs, DMA_S2MM_XFER_EN);
-      // Check if transfer interrupt is enabled.
-      if (crash_get_bit(regs, DMA_S2MM_INTERRUPT)) {
-        if (wait_event_interruptible_timeout(pd->d->irq_s2mm_wait, atomic_read(&pd->d->irq_s2mm) > 0, msecs_to_jiffies(INTERRUPT_TIMEOUT_MSEC)) == 0) {
-          dev_err(&pd->d->pdev->dev, "crash_ioctl(): DMA timeout (Interrupt)\n");
-          crash_clear_bit(regs, DMA_S2MM_XFER_EN);
-          mutex_unlock(&pd->d->s2mm_mutex);
-          return -ETIMEDOUT;
-        }
-        atomic_dec(&pd->d->irq_s2mm);
-      } else {
-        // Poll until DMA is complete or we timeout.
-        // TODO: Use something less hackish than a counter for the timeout code
-        j = 0;
-        while(crash_get_bit(regs, DMA_S2MM_STS_FIFO_EMPTY)) {
-          if (j > 1000000) {
-            dev_err(&pd->d->pdev->dev, "crash_ioctl(): DMA timeout (Polling)\n");
-            crash_clear_bit(regs, DMA_S2MM_XFER_EN);
-            mutex_unlock(&pd->d->s2mm_mutex);
-            return -ETIMEDOUT;
-          }
-          j++;
-        }
-      }
-      // Dummy read on DMA status register, which causes it to read the FIFO (and therefore return the FIFO to the empty state)
-      j = crash_read_reg(regs, DMA_S2MM_STS_FIFO);
-      crash_clear_bit(regs, DMA_S2MM_XFER_EN);
-      mutex_unlock(&pd->d->s2mm_mutex);
-      break;
+static struct attribute *crash_instance_attrs[] = {
+  &dev_attr_instance.attr,
+  &dev_attr_irq.attr,
+  &dev_attr_regs_addr.attr,
+  &dev_attr_regs_len.attr,
+  &dev_attr_of_node.attr,
+  NULL,
+};
 
-    default:
-      return -EFAULT;
+static const struct attribute_group crash_instance_group = {
+  .attrs = crash_instance_attrs,
+};
+
+static const struct attribute_group *crash_groups[] = {
+  &crash_instance_group,
+  &crash_stats_group,
+  NULL,
+};
+
+static int crash_latency_show(struct seq_file *s, void *unused)
+{
+  struct crash_dev_drvdata *d = s->private;
+  int i;
+
+  seq_printf(s, "%-16s %12s %12s\n", "latency_us", "mm2s", "s2mm");
+  for (i = 0; i < CRASH_LAT_BUCKETS; i++) {
+    if (i == 0) {
+      seq_printf(s, "%-16s", "<1");
+    } else if (i == CRASH_LAT_BUCKETS - 1) {
+      seq_printf(s, ">=%-14lu", 1UL << (i - 1));
+    } else {
+      seq_printf(s, "%7lu-%-8lu", 1UL << (i - 1), 1UL << i);
+    }
+    seq_printf(s, " %12lld %12lld\n",
+               (long long)atomic64_read(&d->chan[CRASH_DIR_MM2S].stats.lat_hist[i]),
+               (long long)atomic64_read(&d->chan[CRASH_DIR_S2MM].stats.lat_hist[i]));
   }
   return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(crash_latency);
 
-static irqreturn_t crash_irq_handler(int irq, void *pdata)
+// Queue a CRASH_URING_DMA. Without blocking allowed, anything that would sleep is left to io_uring's
+// worker by returning -EAGAIN.
+static int crash_uring_dma(struct crash_private_data *pd, struct io_uring_cmd *ioucmd, unsigned int issue_flags)
 {
-  struct crash_dev_drvdata *d = pdata;
-  volatile uint32_t *regs = d->regs;
+  const struct crash_uring_dma *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+  bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+  struct crash_dma_desc desc;
+  int result;
 
-  // Check if we received a IRQ due to a DMA transfer
-  if (mutex_is_locked(&d->s2mm_mutex) && !crash_get_bit(regs, DMA_S2MM_STS_FIFO_EMPTY)) {
-    atomic_inc(&d->irq_s2mm);
-    wake_up_interruptible(&d->irq_s2mm_wait);
-  } else if (mutex_is_locked(&d->mm2s_mutex) && !crash_get_bit(regs, DMA_MM2S_STS_FIFO_EMPTY)) {
-    atomic_inc(&d->irq_mm2s);
-    wake_up_interruptible(&d->irq_mm2s_wait);
+  // The SQE stays writable by userspace, read it once
+  memset(&desc, 0, sizeof(struct crash_dma_desc));
+  desc.dir = READ_ONCE(cmd->dir);
+  desc.buff = READ_ONCE(cmd->buff);
+  desc.offset = READ_ONCE(cmd->offset);
+  desc.cmd_data = READ_ONCE(cmd->cmd_data);
+
+  if (nonblock) {
+    if (!READ_ONCE(pd->nbuffs) || !down_read_trylock(&pd->buffs_sem)) return -EAGAIN;
   } else {
-    dev_err(&d->pdev->dev, "crash_irq_handler(): Received errant interrupt\n");
+    if (crash_buffs_attach(pd)) return -ENOMEM;
+    down_read(&pd->buffs_sem);
+  }
+  crash_uring_pdu(ioucmd)->dir = desc.dir;
+  result = crash_dma_submit_one(pd, &desc, ioucmd, nonblock ? GFP_NOWAIT : GFP_KERNEL);
+  up_read(&pd->buffs_sem);
+  if (result == -ENOMEM && nonblock) return -EAGAIN;
+  if (result) return result;
+
+  io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+  return -EIOCBQUEUED;
+}
+
+// Cancel a CRASH_URING_DMA that has not reached the command FIFO. Started DMAs run to completion.
+static void crash_uring_cancel(struct crash_private_data *pd, struct io_uring_cmd *ioucmd)
+{
+  struct crash_uring_pdu *pdu = crash_uring_pdu(ioucmd);
+  struct crash_dma_chan *chan = &pd->d->chan[pdu->dir];
+  unsigned long flags;
+
+  spin_lock_irqsave(&chan->lock, flags);
+  if (pdu->req && !pdu->req->issued) {
+    crash_sched_dequeue(chan, pdu->req);
+    crash_dma_req_complete(pd->d, pdu->req, 0, -ECANCELED);
+  }
+  spin_unlock_irqrestore(&chan->lock, flags);
+}
+
+static int crash_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+  struct crash_private_data *pd = ioucmd->file->private_data;
+  const struct crash_reg_batch *cmd;
+  struct crash_reg_batch batch;
+
+  if (issue_flags & IO_URING_F_CANCEL) {
+    crash_uring_cancel(pd, ioucmd);
+    return 0;
+  }
+
+  switch (ioucmd->cmd_op) {
+    case CRASH_URING_DMA:
+      return crash_uring_dma(pd, ioucmd, issue_flags);
+
+    case CRASH_URING_REG_BATCH:
+      // Copying the ops in may fault and sleep, run from io-wq instead of the submitting task
+      if (issue_flags & IO_URING_F_NONBLOCK) return -EAGAIN;
+      cmd = io_uring_sqe_cmd(ioucmd->sqe);
+      batch.ops = READ_ONCE(cmd->ops);
+      batch.count = READ_ONCE(cmd->count);
+      return crash_reg_batch(pd, &batch);
+
+    default:
+      return -ENOTTY;
   }
-  return IRQ_HANDLED;
 }
 
 static struct file_operations fops = {
@@ -300,13 +3494,250 @@ static struct file_operations fops = {
   .release = crash_close,
   .mmap = crash_mmap,
   .unlocked_ioctl = crash_ioctl,
+  .poll = crash_poll,
+  .read = crash_read,
+  .uring_cmd = crash_uring_cmd,
+};
+
+static int crash_stream_open(struct inode *i, struct file *filp)
+{
+  int result = crash_open_dev(container_of(filp->private_data, struct crash_dev_drvdata, stream_mdev), filp);
+
+  if (result) return result;
+  return stream_open(i, filp);
+}
+
+// Start the stream's ring for one direction unless it is already running
+static int crash_stream_start(struct crash_private_data *pd, int dir)
+{
+  if (pd->ring[dir] && pd->d->chan[dir].ring == pd->ring[dir]) return 0;
+  pd->stream_off[dir] = 0;
+  return crash_ring_start(pd, &pd->stream_cfg[dir]);
+}
+
+// Check if the slot at the stream position can be used: filled (S2MM) or sent (MM2S)
+static bool crash_stream_ready(struct crash_ring *r)
+{
+  struct crash_ring_ctrl *ctrl = r->ctrl;
+
+  if (r->dir == CRASH_DIR_S2MM) return READ_ONCE(ctrl->head) != ctrl->tail;
+  return (uint32_t)(ctrl->head - READ_ONCE(ctrl->tail)) < r->nslots;
+}
+
+// Hand the slot at the stream position back to the driver and refill the command FIFO
+static void crash_stream_advance(struct crash_private_data *pd, struct crash_ring *r)
+{
+  struct crash_dma_chan *chan = &pd->d->chan[r->dir];
+  unsigned long flags;
+
+  if (r->dir == CRASH_DIR_S2MM) {
+    WRITE_ONCE(r->ctrl->tail, r->ctrl->tail + 1);
+  } else {
+    // Slot contents must be written before the index that releases them
+    smp_wmb();
+    WRITE_ONCE(r->ctrl->head, r->ctrl->head + 1);
+  }
+  pd->stream_off[r->dir] = 0;
+  spin_lock_irqsave(&chan->lock, flags);
+  if (chan->ring == r) crash_ring_service(pd->d, r);
+  spin_unlock_irqrestore(&chan->lock, flags);
+}
+
+// Copy between the iterator and the stream's ring slots. S2MM consumes filled slots at tail,
+// MM2S fills slots at head. A slot goes back to the DMA once it has been read / written in full,
+// in transfers of the ring's DMA size. Returns the bytes copied.
+static ssize_t crash_stream_xfer(struct crash_private_data *pd, int dir, struct iov_iter *iter, bool nonblock)
+{
+  struct crash_dma_chan *chan = &pd->d->chan[dir];
+  struct crash_ring *r;
+  uint32_t slot_bytes, idx;
+  size_t copied = 0, len, n;
+  void *slot;
+  int result = 0;
+
+  if (mutex_lock_interruptible(&pd->stream_mutex[dir])) return -ERESTARTSYS;
+  result = crash_stream_start(pd, dir);
+  if (result) goto unlock;
+  r = pd->ring[dir];
+  slot_bytes = crash_cmd_size(r->cmd_data);
+
+  while (iov_iter_count(iter)) {
+    // Stopped under us, e.g. by CRASH_RING_STOP
+    if (chan->ring != r) {
+      result = -EPIPE;
+      break;
+    }
+    if (!crash_stream_ready(r)) {
+      if (copied) break;
+      if (nonblock) {
+        result = -EAGAIN;
+        break;
+      }
+      result = wait_event_interruptible(chan->ring_wait, crash_ring_ready(chan, r));
+      if (result) break;
+      continue;
+    }
+    // Pairs with the barrier in crash_ring_service() that publishes the index
+    smp_rmb();
+    idx = (dir == CRASH_DIR_S2MM) ? r->ctrl->tail : r->ctrl->head;
+    slot = page_address(r->slots[idx % r->nslots]) + pd->stream_off[dir];
+    len = min_t(size_t, slot_bytes - pd->stream_off[dir], iov_iter_count(iter));
+    if (dir == CRASH_DIR_S2MM) {
+      n = copy_to_iter(slot, len, iter);
+    } else {
+      n = copy_from_iter(slot, len, iter);
+    }
+    copied += n;
+    pd->stream_off[dir] += n;
+    if (n < len) {
+      result = -EFAULT;
+      break;
+    }
+    if (pd->stream_off[dir] == slot_bytes) crash_stream_advance(pd, r);
+  }
+
+unlock:
+  mutex_unlock(&pd->stream_mutex[dir]);
+  return copied ? copied : result;
+}
+
+static ssize_t crash_stream_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct file *filp = iocb->ki_filp;
+
+  return crash_stream_xfer(filp->private_data, CRASH_DIR_S2MM, to,
+                           (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+}
+
+static ssize_t crash_stream_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct file *filp = iocb->ki_filp;
+
+  return crash_stream_xfer(filp->private_data, CRASH_DIR_MM2S, from,
+                           (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+}
+
+// A direction whose ring has not started yet is reported ready, read() / write() start it
+static __poll_t crash_stream_poll(struct file *filp, poll_table *wait)
+{
+  struct crash_private_data *pd = filp->private_data;
+  struct crash_dev_drvdata *d = pd->d;
+  __poll_t mask = 0;
+  int dir;
+
+  for (dir = 0; dir < CRASH_NUM_DIRS; dir++) {
+    poll_wait(filp, &d->chan[dir].ring_wait, wait);
+    if (pd->ring[dir] && d->chan[dir].ring == pd->ring[dir] && !crash_stream_ready(pd->ring[dir])) continue;
+    mask |= (dir == CRASH_DIR_S2MM) ? (EPOLLIN | EPOLLRDNORM) : (EPOLLOUT | EPOLLWRNORM);
+  }
+  return mask;
+}
+
+// Send what was written: zero pad a partial MM2S slot and wait for the DMA to drain
+static void crash_stream_flush(struct crash_private_data *pd)
+{
+  struct crash_dma_chan *chan = &pd->d->chan[CRASH_DIR_MM2S];
+  struct crash_ring *r = pd->ring[CRASH_DIR_MM2S];
+  uint32_t off;
+
+  if (!r || chan->ring != r) return;
+  mutex_lock(&pd->stream_mutex[CRASH_DIR_MM2S]);
+  off = pd->stream_off[CRASH_DIR_MM2S];
+  if (off) {
+    memset(page_address(r->slots[r->ctrl->head % r->nslots]) + off, 0, crash_cmd_size(r->cmd_data) - off);
+    crash_stream_advance(pd, r);
+  }
+  mutex_unlock(&pd->stream_mutex[CRASH_DIR_MM2S]);
+
+  if (wait_event_interruptible_timeout(chan->ring_wait, chan->ring != r || READ_ONCE(r->ctrl->tail) == r->ctrl->head,
+                                       msecs_to_jiffies(INTERRUPT_TIMEOUT_MSEC)) == 0) {
+    dev_err(&pd->d->pdev->dev, "crash_stream_flush(): MM2S timeout, dropping unsent data\n");
+  }
+}
+
+static int crash_stream_close(struct inode *i, struct file *filp)
+{
+  crash_stream_flush(filp->private_data);
+  return crash_close(i, filp);
+}
+
+static long crash_stream_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct crash_private_data *pd = filp->private_data;
+  struct crash_ring_config cfg;
+  int result = 0;
+
+  if (cmd != CRASH_STREAM_CONFIG) return crash_ioctl(filp, cmd, arg);
+
+  if (copy_from_user(&cfg, (void __user *)arg, sizeof(struct crash_ring_config))) return -EFAULT;
+  if (cfg.dir >= CRASH_NUM_DIRS || cfg.flags) return -EINVAL;
+  if (crash_cmd_size(cfg.cmd_data) == 0 || crash_cmd_size(cfg.cmd_data) > cfg.slot_size) return -EINVAL;
+  if (mutex_lock_interruptible(&pd->stream_mutex[cfg.dir])) return -ERESTARTSYS;
+  if (pd->ring[cfg.dir]) {
+    // Ring memory lives until close, see crash_ring_start()
+    result = -EBUSY;
+  } else {
+    pd->stream_cfg[cfg.dir] = cfg;
+  }
+  mutex_unlock(&pd->stream_mutex[cfg.dir]);
+  return result;
+}
+
+static struct file_operations stream_fops = {
+  .owner = THIS_MODULE,
+  .open = crash_stream_open,
+  .release = crash_stream_close,
+  .unlocked_ioctl = crash_stream_ioctl,
+  .uring_cmd = crash_uring_cmd,
+  .poll = crash_stream_poll,
+  .read_iter = crash_stream_read_iter,
+  .write_iter = crash_stream_write_iter,
+  .splice_read = copy_splice_read,
+  .splice_write = iter_file_splice_write,
 };
 
+static void crash_pool_free(struct crash_dev_drvdata *d)
+{
+  unsigned int i;
+
+  for (i = 0; i < d->pool_size; i++) {
+    dma_free_coherent(&d->pdev->dev, d->pool[i].len, d->pool[i].cpu_addr, d->pool[i].dma_addr);
+  }
+  kfree(d->pool);
+  bitmap_free(d->pool_used);
+  d->pool_size = 0;
+}
+
+// Reserve the default DMA buffers while memory is still unfragmented. They come from CMA, or from
+// the devicetree memory-region if the node has one. A short pool is not fatal, buffers past it
+// are allocated when they are attached.
+static void crash_pool_alloc(struct crash_dev_drvdata *d)
+{
+  unsigned int i;
+
+  spin_lock_init(&d->pool_lock);
+  if (!pool_buffs) return;
+  d->pool = kcalloc(pool_buffs, sizeof(struct crash_buff), GFP_KERNEL);
+  d->pool_used = bitmap_zalloc(pool_buffs, GFP_KERNEL);
+  if (!d->pool || !d->pool_used) {
+    crash_pool_free(d);
+    return;
+  }
+  for (i = 0; i < pool_buffs; i++) {
+    if (crash_buff_alloc_one(&d->pdev->dev, &d->pool[i], (1 << PAGE_ORDER) * PAGE_SIZE, CRASH_BUFF_COHERENT)) break;
+    d->pool_size = i + 1;
+  }
+  if (d->pool_size < pool_buffs) {
+    dev_warn(&d->pdev->dev, "crash_pool_alloc(): Reserved %u of %u DMA buffers\n", d->pool_size, pool_buffs);
+  }
+}
+
 static int crash_probe(struct platform_device *pdev)
 {
   struct crash_dev_drvdata *d;
   struct resource *regs, *irq;
   int result;
+  int i, prio;
 
   d = devm_kzalloc(&pdev->dev, sizeof(struct crash_dev_drvdata), GFP_KERNEL);
   if (!d) {
@@ -316,16 +3747,26 @@ static int crash_probe(struct platform_device *pdev)
   d->pdev = pdev;
   dev_set_drvdata(&pdev->dev, d);
 
-  regs = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-  if (!regs) {
-    dev_err(&pdev->dev, "crash_probe(): Error getting regs resource from devicetree\n");
-    return -EIO;
-  }
+  // crash-emu passes its register window in memory instead of a MEM resource
+  d->emu = dev_get_platdata(&pdev->dev);
+  if (d->emu) {
+    d->regs = d->emu->regs;
+    d->regs_phys_addr = (uint32_t)virt_to_phys(d->emu->regs);
+    d->regs_len = d->emu->regs_len;
+  } else {
+    regs = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    if (!regs) {
+      dev_err(&pdev->dev, "crash_probe(): Error getting regs resource from devicetree\n");
+      return -EIO;
+    }
 
-  d->regs = (uint32_t*)devm_ioremap_resource(&pdev->dev, regs);
-  if (d->regs < 0) {
-    dev_err(&pdev->dev, "crash_probe(): Error mapping control & status registers\n");
-    return -EIO;
+    d->regs = (uint32_t*)devm_ioremap_resource(&pdev->dev, regs);
+    if (d->regs < 0) {
+      dev_err(&pdev->dev, "crash_probe(): Error mapping control & status registers\n");
+      return -EIO;
+    }
+    d->regs_phys_addr = (uint32_t)regs->start;
+    d->regs_len = resource_size(regs);
   }
 
   irq = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
@@ -334,38 +3775,132 @@ static int crash_probe(struct platform_device *pdev)
     return -EIO;
   }
   d->irq = irq->start;
-  init_waitqueue_head(&d->irq_s2mm_wait);
-  init_waitqueue_head(&d->irq_mm2s_wait);
+
+  // The DMA engines take 32-bit addresses
+  result = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+  if (result) {
+    dev_err(&pdev->dev, "crash_probe(): No suitable DMA mask\n");
+    return result;
+  }
+
+  // Optional memory-region for the DMA buffer pool
+  result = of_reserved_mem_device_init(&pdev->dev);
+  if (result && result != -ENODEV) {
+    dev_warn(&pdev->dev, "crash_probe(): Error using reserved memory region (%d)\n", result);
+  }
+
+  for (i = 0; i < CRASH_NUM_DIRS; i++) {
+    init_rwsem(&d->chan[i].sem);
+    init_waitqueue_head(&d->chan[i].irq_wait);
+    init_waitqueue_head(&d->chan[i].ring_wait);
+    spin_lock_init(&d->chan[i].lock);
+    for (prio = 0; prio < CRASH_SCHED_PRIOS; prio++) {
+      INIT_LIST_HEAD(&d->chan[i].active[prio]);
+    }
+    INIT_LIST_HEAD(&d->chan[i].inflight);
+  }
 
   // Setup control registers
-  d->regs_phys_addr = (uint32_t)regs->start;
-  d->regs_len = resource_size(regs);
+  spin_lock_init(&d->shadow_lock);
+  INIT_LIST_HEAD(&d->thresh_fds);
+  spin_lock_init(&d->thresh_lock);
+  spin_lock_init(&d->trig_lock);
+  d->shadow = vmalloc_user(REGS_TOTAL_ADDR_SPACE);
+  if (!d->shadow) {
+    dev_err(&pdev->dev, "crash_probe(): Error allocating shadow registers\n");
+    result = -ENOMEM;
+    goto err_shadow;
+  }
+  crash_shadow_load(d);
+  spin_lock_init(&d->status_lock);
+  d->status = vmalloc_user(PAGE_SIZE);
+  if (!d->status) {
+    dev_err(&pdev->dev, "crash_probe(): Error allocating status page\n");
+    result = -ENOMEM;
+    goto err_shadow;
+  }
+  crash_pool_alloc(d);
+
+  // Number the instance. A "crashN" devicetree alias fixes its number, otherwise take the next free one.
+  d->id = of_alias_get_id(pdev->dev.of_node, "crash");
+  if (d->id >= 0) {
+    d->id = ida_alloc_range(&crash_ida, d->id, d->id, GFP_KERNEL);
+  } else {
+    d->id = ida_alloc(&crash_ida, GFP_KERNEL);
+  }
+  if (d->id < 0) {
+    dev_err(&pdev->dev, "crash_probe(): Error allocating instance number\n");
+    result = d->id;
+    goto err_shadow;
+  }
+  // Instance 0 keeps the original /dev/crash name
+  if (d->id == 0) {
+    snprintf(d->name, sizeof(d->name), "crash");
+  } else {
+    snprintf(d->name, sizeof(d->name), "crash%d", d->id);
+  }
+
+  // Setup interrupt handler, named after the instance so it can be found in /proc/interrupts
+  if (irq_threaded) {
+    result = devm_request_threaded_irq(&d->pdev->dev, d->irq, NULL, crash_irq_thread, IRQF_ONESHOT, d->name, d);
+  } else {
+    result = devm_request_irq(&d->pdev->dev, d->irq, crash_irq_handler, 0, d->name, d);
+  }
+  if (result) {
+    dev_err(&d->pdev->dev, "crash_probe(): Could not request IRQ %d\n", d->irq);
+    result = -EBUSY;
+    goto err_ida;
+  }
 
   // Initialize misc device
-  d->mdev.name = "crash";
+  d->mdev.name = d->name;
   d->mdev.fops = &fops,
   d->mdev.minor = MISC_DYNAMIC_MINOR;
+  d->mdev.parent = &pdev->dev;
+  d->mdev.groups = crash_groups;
 
   result = misc_register(&d->mdev);
   if (result) {
     dev_err(&pdev->dev, "crash_probe(): Failed to register misc device\n");
+    devm_free_irq(&d->pdev->dev, d->irq, d);
+    goto err_ida;
   }
 
-  // Setup interrupt handler
-  if (devm_request_irq(&d->pdev->dev, d->irq, crash_irq_handler, 0, "crash", d)) {
-    dev_err(&d->pdev->dev, "crash_probe(): Could not request IRQ %d\n", d->irq);
-    return -EBUSY;
-  } else {
-    atomic_set(&d->irq_s2mm, 0);
-    atomic_set(&d->irq_mm2s, 0);
+  snprintf(d->stream_name, sizeof(d->stream_name), "%s-stream", d->name);
+  d->stream_mdev.name = d->stream_name;
+  d->stream_mdev.fops = &stream_fops;
+  d->stream_mdev.minor = MISC_DYNAMIC_MINOR;
+  d->stream_mdev.parent = &pdev->dev;
+
+  result = misc_register(&d->stream_mdev);
+  if (result) {
+    dev_err(&pdev->dev, "crash_probe(): Failed to register stream misc device\n");
+    misc_deregister(&d->mdev);
+    devm_free_irq(&d->pdev->dev, d->irq, d);
+    goto err_ida;
   }
 
-  // Setup mutexs for access to DMA transfers
-  mutex_init(&d->s2mm_mutex);
-  mutex_init(&d->mm2s_mutex);
+  // Latency histograms, failure here only loses the debug output
+  d->debugfs = debugfs_create_dir(d->mdev.name, NULL);
+  debugfs_create_file("latency", 0444, d->debugfs, d, &crash_latency_fops);
+
+  if (monitor_us) {
+    hrtimer_init(&d->monitor, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    d->monitor.function = crash_monitor;
+    hrtimer_start(&d->monitor, us_to_ktime(monitor_us), HRTIMER_MODE_REL);
+  }
 
-  dev_info(&d->pdev->dev, "crash_probe(): Probe complete\n");
+  dev_info(&d->pdev->dev, "crash_probe(): Probe complete, /dev/%s\n", d->name);
   return 0;
+
+err_ida:
+  ida_free(&crash_ida, d->id);
+err_shadow:
+  crash_pool_free(d);
+  vfree(d->status);
+  vfree(d->shadow);
+  of_reserved_mem_device_release(&pdev->dev);
+  return result;
 }
 
 static int crash_remove(struct platform_device *pdev)
@@ -373,10 +3908,19 @@ static int crash_remove(struct platform_device *pdev)
   struct crash_dev_drvdata *d;
   d = dev_get_drvdata(&pdev->dev);
 
+  if (monitor_us) hrtimer_cancel(&d->monitor);
+  crash_trigs_remove(d, NULL);
   devm_free_irq(&d->pdev->dev, d->irq, d);
 
+  debugfs_remove_recursive(d->debugfs);
+  misc_deregister(&d->stream_mdev);
   misc_deregister(&d->mdev);
 
+  ida_free(&crash_ida, d->id);
+  crash_pool_free(d);
+  vfree(d->status);
+  vfree(d->shadow);
+  of_reserved_mem_device_release(&pdev->dev);
   devm_kfree(&pdev->dev, d);
 
   return 0;
@@ -23,6 +23,12 @@
 #ifndef CRASH_KMOD_H
 #define CRASH_KMOD_H
 
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,6 +38,13 @@ extern "C" {
 #define INTERRUPT_TIMEOUT_MSEC        1000
 #define MMAP_REGS                     0x1000
 #define MMAP_DMA_BUFF                 0x2000
+#define MMAP_DMA_BUFF_IDX(i)          (MMAP_DMA_BUFF + (i)*0x1000)
+#define MMAP_RING_MM2S                0x80000
+#define MMAP_RING_S2MM                0x81000
+#define MMAP_REGS_SHADOW              0x82000
+#define MMAP_STATUS                   0x83000
+#define MMAP_LEASE_MM2S               0x84000
+#define MMAP_LEASE_S2MM               0x85000
 #define REGS_ADDR_SIZE                256
 #define REGS_TOTAL_ADDR_SPACE         0x20000
 #define RX_PHASE_CAL                  460
@@ -488,6 +501,453 @@ extern "C" {
 #define CRASH_DMA_WRITE                   _IO(CRASH_IOCTL_BASE, 0x43)
 #define CRASH_DMA_READ                    _IO(CRASH_IOCTL_BASE, 0x44)
 #define CRASH_GET_DMA_PHYS_ADDR           _IO(CRASH_IOCTL_BASE, 0x45)
+#define CRASH_RING_START                  _IOW(CRASH_IOCTL_BASE, 0x46, struct crash_ring_config)
+#define CRASH_RING_STOP                   _IO(CRASH_IOCTL_BASE, 0x47)
+#define CRASH_RING_KICK                   _IO(CRASH_IOCTL_BASE, 0x48)
+#define CRASH_RING_WAIT                   _IO(CRASH_IOCTL_BASE, 0x49)
+#define CRASH_DMA_SUBMIT                  _IOWR(CRASH_IOCTL_BASE, 0x4A, struct crash_dma_submit)
+#define CRASH_DMA_XFER                    _IOWR(CRASH_IOCTL_BASE, 0x4B, struct crash_dma_xfer)
+#define CRASH_SET_POLL_POLICY             _IOW(CRASH_IOCTL_BASE, 0x4C, struct crash_poll_policy)
+#define CRASH_ALLOC_BUFFS                 _IOWR(CRASH_IOCTL_BASE, 0x4D, struct crash_buff_alloc)
+#define CRASH_SYNC_FOR_CPU                _IOW(CRASH_IOCTL_BASE, 0x4E, struct crash_buff_sync)
+#define CRASH_SYNC_FOR_DEVICE             _IOW(CRASH_IOCTL_BASE, 0x4F, struct crash_buff_sync)
+#define CRASH_REGISTER_BUFF               _IOWR(CRASH_IOCTL_BASE, 0x50, struct crash_buff_register)
+#define CRASH_UNREGISTER_BUFF             _IO(CRASH_IOCTL_BASE, 0x51)
+#define CRASH_REG_BATCH                   _IOW(CRASH_IOCTL_BASE, 0x52, struct crash_reg_batch)
+#define CRASH_THRESH_EVENTS               _IO(CRASH_IOCTL_BASE, 0x53)
+#define CRASH_SET_SCHED                   _IOW(CRASH_IOCTL_BASE, 0x54, struct crash_sched)
+#define CRASH_CHAN_LEASE                  _IOWR(CRASH_IOCTL_BASE, 0x55, struct crash_lease_config)
+#define CRASH_CHAN_RELEASE                _IO(CRASH_IOCTL_BASE, 0x56)
+#define CRASH_CHAN_WAKE                   _IO(CRASH_IOCTL_BASE, 0x57)
+#define CRASH_STREAM_CONFIG               _IOW(CRASH_IOCTL_BASE, 0x58, struct crash_ring_config)
+#define CRASH_FIFO_EVENTS                 _IO(CRASH_IOCTL_BASE, 0x59)
+#define CRASH_TRIG_SET                    _IOWR(CRASH_IOCTL_BASE, 0x5A, struct crash_trig)
+#define CRASH_TRIG_CLEAR                  _IO(CRASH_IOCTL_BASE, 0x5B)
+
+// DMA directions, used as the argument of the ring ioctls
+#define CRASH_DIR_MM2S                    0
+#define CRASH_DIR_S2MM                    1
+#define CRASH_NUM_DIRS                    2
+
+// Completion stamps
+//
+// Every DMA completion carries a struct crash_stamp: when the driver saw it (once per interrupt or
+// poll, so DMAs retired together share a time), DMA_*_XFER_CNT read at that moment and, for S2MM,
+// an estimate of the ADC sample index of the buffer's first sample. The estimate counts the bytes
+// received on the DMA's TDEST since USRP_RX_ENABLE was last set through the driver, in samples of
+// 8 bytes (4 with USRP_RX_FIX2FLOAT_BYPASS), times the decimation set at completion time
+// (USRP_RX_CIC_DECIM unless USRP_RX_CIC_BYPASS, times 2 unless USRP_RX_HB_BYPASS). Failed DMAs
+// have a zero stamp.
+struct crash_stamp {
+  uint64_t timestamp_ns;            // CLOCK_MONOTONIC time the completion was seen
+  uint64_t sample_index;            // S2MM: estimated ADC sample index of the first sample
+  uint32_t xfer_cnt;                // DMA_*_XFER_CNT when the completion was seen
+  uint32_t reserved;
+};
+
+// Streaming rings
+//
+// CRASH_RING_START allocates nslots DMA buffers for one direction and keeps the command FIFO
+// filled from the interrupt handler. The ring is mmap'd at MMAP_RING_MM2S / MMAP_RING_S2MM:
+// a struct crash_ring_ctrl page followed by the slots, each slot_size bytes apart starting at
+// data_offset. head and tail are free running slot counters (slot = index % nslots).
+//
+// S2MM: the driver advances head as slots are filled, userspace advances tail as it consumes them.
+// MM2S: userspace advances head as it fills slots, the driver advances tail as they are sent.
+//
+// If the DMA runs out of work (S2MM ring full, MM2S ring empty) the driver sets CRASH_RING_NEED_KICK
+// and userspace must issue CRASH_RING_KICK (or CRASH_RING_WAIT) after moving its index.
+// With CRASH_RING_LOOP the slots are queued once and recirculated by the DMA via DMA_*_CMD_FIFO_LOOP,
+// so the stream never stalls. Slots userspace has not released are then overwritten and counted
+// in overruns. CRASH_RING_LOOP is S2MM only: slots are streaming mappings synced as the driver
+// queues them, so an MM2S loop would resend stale cache contents and is rejected with -EINVAL.
+#define CRASH_RING_MAX_SLOTS              32
+#define CRASH_RING_LOOP                   (1 << 0)
+#define CRASH_RING_NEED_KICK              (1 << 0)
+
+struct crash_ring_config {
+  uint32_t dir;                     // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  uint32_t nslots;                  // Number of slots, up to CRASH_RING_MAX_SLOTS
+  uint32_t slot_size;               // Bytes per slot, rounded up to a power of two pages
+  uint32_t cmd_data;                // DMA_*_CMD_DATA word used for every slot (size, TDEST, EN)
+  uint32_t flags;                   // CRASH_RING_LOOP
+};
+
+struct crash_ring_ctrl {
+  volatile uint32_t head;           // Producer index
+  volatile uint32_t tail;           // Consumer index
+  volatile uint32_t flags;          // CRASH_RING_NEED_KICK
+  volatile uint32_t overruns;       // Slots overwritten / resent before userspace released them
+  uint32_t          nslots;
+  uint32_t          slot_size;
+  uint32_t          data_offset;    // Offset of slot 0 from the start of the mapping
+  uint32_t          reserved;
+  struct crash_stamp stamps[CRASH_RING_MAX_SLOTS]; // Last completion of each slot, valid with head / tail
+};
+
+// Stream node
+//
+// Each device also registers <name>-stream (e.g. /dev/crash-stream) whose read() and write()
+// carry sample data instead of events: read() returns what S2MM receives and written data is
+// sent by MM2S. Each direction runs a streaming ring that starts on the first read() / write(),
+// with the stream_slots and stream_slot_size module parameters unless CRASH_STREAM_CONFIG set
+// the geometry and DMA_*_CMD_DATA (TDEST) before that; flags must be 0. Data moves in whole
+// DMAs of the configured size, close() zero pads a partial MM2S one and waits for it to be sent.
+// splice() works in both directions, so samples can go between the device and a file, pipe or
+// socket without passing through userspace. The other ioctls work as on the main node.
+
+// Exclusive channels
+//
+// CRASH_CHAN_LEASE gives the file descriptor one DMA direction to itself, like a streaming ring,
+// but each transfer is described by userspace. A submission queue (SQ) of struct crash_sqe and a
+// completion queue (CQ) of struct crash_cqe live in memory shared with the driver, mmap'd at
+// MMAP_LEASE_MM2S / MMAP_LEASE_S2MM (mmap_len bytes): a struct crash_lease_ctrl page, then the
+// SQ at sq_offset and the CQ at cq_offset. Indices are free running (entry = index % entries).
+//
+// Userspace writes SQEs and then advances sq_tail, and consumes CQEs up to cq_tail, advancing
+// cq_head. A driver thread takes SQEs while there is room in the command FIFO and in the CQ and
+// retires completions by polling the status FIFO, or from the interrupt if it is enabled, so
+// transfers are submitted and reaped without system calls. After idle_us without work the
+// thread sets CRASH_LEASE_NEED_WAKEUP and sleeps: check the flag after advancing sq_tail and
+// issue CRASH_CHAN_WAKE if it is set. Invalid SQEs complete at once with error -EINVAL, so CQEs
+// may come back out of order. CRASH_CHAN_RELEASE (or close) cancels the DMAs still in flight.
+// Buffers cannot be allocated, registered or unregistered while the file descriptor holds a lease.
+// Streaming buffers still need CRASH_SYNC_FOR_CPU / CRASH_SYNC_FOR_DEVICE, so the system call free
+// path wants coherent buffers.
+#define CRASH_LEASE_MAX_ENTRIES           1024
+#define CRASH_LEASE_IDLE_US_DEFAULT       1000
+#define CRASH_LEASE_NEED_WAKEUP           (1 << 0)
+
+struct crash_lease_config {
+  uint32_t dir;                     // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  uint32_t entries;                 // SQ and CQ length, a power of two up to CRASH_LEASE_MAX_ENTRIES
+  uint32_t idle_us;                 // Polling time before the thread sleeps, 0 for CRASH_LEASE_IDLE_US_DEFAULT
+  uint32_t mmap_len;                // Out: length of the MMAP_LEASE_* mapping
+};
+
+struct crash_sqe {
+  uint64_t user_data;               // Returned in the CQE
+  uint32_t buff;                    // DMA buffer index or user buffer handle
+  uint32_t offset;                  // Byte offset into the buffer
+  uint32_t cmd_data;                // DMA_*_CMD_DATA word (size, TDEST, EN)
+  uint32_t reserved;
+};
+
+struct crash_cqe {
+  uint64_t user_data;
+  uint32_t status;                  // DMA_*_STS_FIFO word, 0 while status is read automatically
+  int32_t  error;                   // 0 or negative errno
+  uint32_t bytes;
+  uint32_t reserved;
+  struct crash_stamp stamp;
+};
+
+struct crash_lease_ctrl {
+  volatile uint32_t sq_head;        // Written by the driver
+  volatile uint32_t sq_tail;        // Written by userspace
+  volatile uint32_t cq_head;        // Written by userspace
+  volatile uint32_t cq_tail;        // Written by the driver
+  volatile uint32_t flags;          // CRASH_LEASE_NEED_WAKEUP
+  uint32_t          entries;
+  uint32_t          sq_offset;      // Offset of the SQ from the start of the mapping
+  uint32_t          cq_offset;      // Offset of the CQ from the start of the mapping
+};
+
+// Status page
+//
+// Read only, mmap'd at MMAP_STATUS (one page), updated on every interrupt and by the threads of
+// exclusive channels. seq is odd while an update is in progress: read seq, the fields, then seq
+// again, and retry if it changed or was odd.
+struct crash_status_page {
+  volatile uint32_t seq;
+  volatile uint32_t usrp_bank7;     // USRP_BANK7: clock lock, RX FIFO overflow, TX FIFO underflow, ...
+  volatile uint32_t rx_overflows;   // USRP_RX_FIFO_OVERFLOW episodes, see the USRP FIFO monitor
+  volatile uint32_t tx_underflows;  // USRP_TX_FIFO_UNDERFLOW episodes
+  volatile uint64_t updated_ns;     // CLOCK_MONOTONIC time of the update
+  volatile uint64_t transfers[CRASH_NUM_DIRS]; // DMAs completed per direction
+};
+
+// Asynchronous DMA
+//
+// CRASH_DMA_SUBMIT queues a batch of transfers and returns immediately. Each transfer produces a
+// struct crash_event of type CRASH_EVENT_DMA, which is read() from the device. poll() / epoll
+// reports POLLIN while events are waiting. At most CRASH_EVENT_QUEUE_LEN transfers and unread
+// events can be outstanding per file descriptor, submissions past that are cut short.
+#define CRASH_EVENT_QUEUE_LEN             256
+#define CRASH_EVENT_DMA                   1
+#define CRASH_EVENT_THRESHOLD             2
+#define CRASH_EVENT_FIFO                  3
+
+struct crash_dma_desc {
+  uint64_t user_data;               // Returned in the completion event
+  uint32_t dir;                     // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  uint32_t cmd_data;                // DMA_*_CMD_DATA word (size, TDEST, EN)
+  uint32_t offset;                  // Byte offset into the DMA buffer
+  uint32_t buff;                    // DMA buffer index
+};
+
+struct crash_dma_submit {
+  uint64_t descs;                   // Pointer to an array of struct crash_dma_desc
+  uint32_t count;                   // Number of descriptors
+  uint32_t submitted;               // Out: number of descriptors queued
+};
+
+struct crash_event {
+  uint32_t type;                    // CRASH_EVENT_*
+  int32_t  error;                   // 0 or negative errno
+  uint64_t user_data;
+  union {
+    struct {
+      uint32_t dir;
+      uint32_t status;              // DMA_*_STS_FIFO word, 0 while status is read automatically
+      uint32_t bytes;
+      uint32_t tdest;
+      struct crash_stamp stamp;
+    } dma;
+    struct {
+      uint32_t index;               // SPEC_SENSE_THRESHOLD_EXCEEDED_INDEX
+      uint32_t mag;                 // SPEC_SENSE_THRESHOLD_EXCEEDED_MAG
+      uint64_t timestamp_ns;        // CLOCK_MONOTONIC time of the interrupt
+      uint32_t lost;                // Events dropped before this one because the queue was full
+    } thresh;
+    struct {
+      uint32_t dir;                 // CRASH_DIR_S2MM: RX FIFO overflow, CRASH_DIR_MM2S: TX FIFO underflow
+      uint32_t tdest;               // S2MM: USRP_AXIS_MASTER_TDEST, the stream that lost samples
+      uint64_t timestamp_ns;        // CLOCK_MONOTONIC time the driver saw it
+      uint32_t count;               // Episodes in this direction since probe
+      uint32_t lost;                // Events dropped before this one because the queue was full
+    } fifo;
+    uint64_t raw[6];
+  } u;
+};
+
+// io_uring
+//
+// DMAs and register batches can be issued with IORING_OP_URING_CMD on the device, so they share a
+// ring with disk and socket I/O. sqe->cmd_op selects the command and its payload sits in the
+// command area of the SQE (sqe->cmd):
+//   CRASH_URING_DMA        struct crash_uring_dma. Queued like a CRASH_DMA_SUBMIT descriptor, the
+//                          CQE is posted when the DMA completes: res is the bytes moved or a negative
+//                          errno, and big CQEs (IORING_SETUP_CQE32) carry the DMA_*_STS_FIFO word in
+//                          big_cqe[0]. Fails with -EAGAIN while CRASH_EVENT_QUEUE_LEN are outstanding.
+//   CRASH_URING_REG_BATCH  struct crash_reg_batch, runs from io_uring's worker threads as it may
+//                          sleep, res is 0 or a negative errno.
+// buff is a DMA buffer index or a CRASH_REGISTER_BUFF handle, which pins and maps user memory once
+// instead of per DMA. Cancelling (e.g. IORING_OP_ASYNC_CANCEL) only stops DMAs that have not reached
+// the command FIFO yet, the others complete normally.
+#define CRASH_URING_DMA                   0x01
+#define CRASH_URING_REG_BATCH             0x02
+
+struct crash_uring_dma {
+  uint32_t dir;                     // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  uint32_t buff;                    // DMA buffer index
+  uint32_t offset;                  // Byte offset into the DMA buffer
+  uint32_t cmd_data;                // DMA_*_CMD_DATA word (size, TDEST, EN)
+};
+
+// Spectrum sense threshold events
+//
+// CRASH_THRESH_EVENTS with a non-zero argument subscribes the file descriptor to threshold
+// interrupts, zero unsubscribes. Set SPEC_SENSE_ENABLE_THRESHOLD_IRQ (e.g. with CRASH_REG_BATCH)
+// to enable them. Each interrupt latches the exceeded index and magnitude, clears
+// SPEC_SENSE_CLEAR_THRESHOLD_LATCHED and is read() as a struct crash_event of type
+// CRASH_EVENT_THRESHOLD. Up to CRASH_THRESH_QUEUE_LEN of them wait per file descriptor.
+#define CRASH_THRESH_QUEUE_LEN            64
+
+// USRP FIFO monitor
+//
+// The driver checks USRP_RX_FIFO_OVERFLOW and USRP_TX_FIFO_UNDERFLOW on every interrupt and every
+// monitor_us (module parameter, 1 ms by default) from a timer. Each time one is found set counts
+// as an episode: it is cleared through its *_CLR bit, counted in the status page and in the
+// s2mm_fifo_errors / mm2s_fifo_errors stats, and read() as a struct crash_event of type
+// CRASH_EVENT_FIFO by file descriptors subscribed with CRASH_FIFO_EVENTS (non-zero argument,
+// zero unsubscribes). FIFO events share the CRASH_THRESH_QUEUE_LEN queue with threshold events.
+
+// DMA scheduling
+//
+// Blocking and asynchronous DMAs from every file descriptor share each direction's command FIFO.
+// Waiting DMAs are queued per file descriptor and TDEST, and fed to the FIFO by priority, 0 first,
+// then within a priority by deficit round robin: each stream may send weight * CRASH_SCHED_QUANTUM
+// bytes per round. Priorities are strict, a busy high priority stream starves lower ones.
+// CRASH_SET_SCHED sets the priority and weight of the calling file descriptor's streams; a stream
+// that already has DMAs waiting picks the change up once it drains.
+#define CRASH_SCHED_PRIOS                 4
+#define CRASH_SCHED_PRIO_DEFAULT          1
+#define CRASH_SCHED_MAX_WEIGHT            64
+#define CRASH_SCHED_QUANTUM               65536
+#define CRASH_NUM_TDEST                   (1 << DMA_S2MM_CMD_TDEST_N)
+
+struct crash_sched {
+  uint32_t prio;                    // 0 (highest) to CRASH_SCHED_PRIOS-1, default CRASH_SCHED_PRIO_DEFAULT
+  uint32_t weight;                  // 1 to CRASH_SCHED_MAX_WEIGHT, default 1
+};
+
+// Blocking DMA with a per call deadline
+//
+// The caller first spins on the DMA status for up to spin_us, which gives the lowest latency for
+// short transfers. After that it sleeps until the interrupt fires or, with interrupts disabled,
+// polls the status every sleep_min_us to sleep_max_us. wait_ns returns how long the wait took.
+// Spin budgets above the poll_spin_max_us module parameter are rejected with -EINVAL.
+#define CRASH_SPIN_DEFAULT                0xFFFFFFFF
+
+struct crash_dma_xfer {
+  uint32_t dir;                     // CRASH_DIR_MM2S or CRASH_DIR_S2MM
+  uint32_t buff;                    // DMA buffer index
+  uint32_t cmd_data;                // DMA_*_CMD_DATA word (size, TDEST, EN)
+  uint32_t offset;                  // Byte offset into the DMA buffer
+  uint32_t timeout_us;              // Deadline, 0 for INTERRUPT_TIMEOUT_MSEC
+  uint32_t spin_us;                 // Spin budget, CRASH_SPIN_DEFAULT to follow the poll policy
+  uint32_t status;                  // Out: DMA_*_STS_FIFO word
+  uint32_t reserved;
+  uint64_t wait_ns;                 // Out: time spent waiting for the DMA
+  struct crash_stamp stamp;         // Out
+};
+
+// Poll policy of a file descriptor, used by CRASH_DMA_READ / CRASH_DMA_WRITE and CRASH_SPIN_DEFAULT.
+// Transfers up to spin_max_bytes spin for spin_us, larger ones go straight to sleeping.
+struct crash_poll_policy {
+  uint32_t spin_max_bytes;
+  uint32_t spin_us;
+  uint32_t sleep_min_us;
+  uint32_t sleep_max_us;
+};
+
+// DMA buffers
+//
+// Every file descriptor has one coherent (1 << PAGE_ORDER) * PAGE_SIZE buffer, index 0. It is
+// attached on the first DMA, mmap or CRASH_GET_DMA_PHYS_ADDR rather than at open, taken from a
+// pool the driver reserves at probe (pool_buffs module parameter) while one is free, and returned
+// to the pool on close.
+// CRASH_ALLOC_BUFFS replaces them with count buffers of at least size bytes each (size returns
+// the rounded up length). Buffer i is mmap'd at MMAP_DMA_BUFF_IDX(i), buffer 0 also at MMAP_DMA_BUFF.
+// Buffers cannot be replaced while any of them is mapped or has a DMA outstanding.
+//
+// Coherent buffers need no maintenance: they are mapped uncached unless the device tree marks
+// the device dma-coherent (ACP). Streaming buffers are mapped cached and ownership is handed over
+// explicitly: CRASH_SYNC_FOR_DEVICE after the CPU writes and before an MM2S / S2MM DMA is
+// submitted, CRASH_SYNC_FOR_CPU after an S2MM DMA completes and before the CPU reads.
+#define CRASH_MAX_BUFFS                   16
+#define CRASH_MAX_BUFF_SIZE               (1 << 22)
+#define CRASH_BUFF_COHERENT               0
+#define CRASH_BUFF_STREAMING              1
+
+struct crash_buff_alloc {
+  uint32_t count;
+  uint32_t size;
+  uint32_t mode;                    // CRASH_BUFF_COHERENT or CRASH_BUFF_STREAMING
+  uint32_t reserved;
+};
+
+// User buffers
+//
+// CRASH_REGISTER_BUFF pins len bytes of user memory at addr and maps it for DMA. The returned
+// handle is used in place of a DMA buffer index in struct crash_dma_xfer, struct crash_dma_desc
+// and struct crash_buff_sync, and is released with CRASH_UNREGISTER_BUFF (arg = handle) or on
+// close. The memory is cached, so it follows the streaming buffer sync rules.
+//
+// The DMA engines take one address per command, so a single DMA must not cross a physically
+// discontiguous boundary of the user buffer. nsegs reports how many contiguous pieces the
+// buffer was mapped as. Huge page backed buffers map as one piece per huge page.
+#define CRASH_MAX_USER_BUFFS              16
+#define CRASH_USER_BUFF_BASE              0x100
+#define CRASH_USER_BUFF(i)                (CRASH_USER_BUFF_BASE + (i))
+
+struct crash_buff_register {
+  uint64_t addr;
+  uint32_t len;
+  uint32_t handle;                  // Out
+  uint32_t nsegs;                   // Out
+  uint32_t reserved;
+};
+
+struct crash_buff_sync {
+  uint32_t buff;                    // DMA buffer index
+  uint32_t offset;                  // Byte range to sync
+  uint32_t len;
+  uint32_t reserved;
+};
+
+// Shadow registers
+//
+// The driver keeps a copy of the banks that only software writes, mmap'd read-only at
+// MMAP_REGS_SHADOW (REGS_TOTAL_ADDR_SPACE bytes, same layout as MMAP_REGS). Fields of these banks
+// can be read with crash_read_reg_shadow / crash_get_bit_shadow instead of over the bus. The copy
+// only follows writes made by the driver, so updates to shadowed banks must go through the
+// ioctls (e.g. CRASH_REG_BATCH) rather than the mmap'd registers. Status banks are not shadowed,
+// and the read only DMA_*_XFER_IN_PROGRESS bits of DMA_BANK0 always read 0 in the shadow.
+#define crash_reg_in_range(bank,lo,hi)    ((uint32_t)((bank) - (lo)) <= (uint32_t)((hi) - (lo)))
+#define crash_reg_shadowed(bank)          (crash_reg_in_range(bank, DMA_BANK0_BASE, DMA_BANK1_BASE) || \
+                                           crash_reg_in_range(bank, USRP_BANK0_BASE, USRP_BANK6_BASE) || \
+                                           crash_reg_in_range(bank, SPEC_SENSE_BANK0_BASE, SPEC_SENSE_BANK2_BASE) || \
+                                           crash_reg_in_range(bank, GLOBAL_BANK0_BASE, GLOBAL_BANK1_BASE))
+
+// Batched register access
+//
+// CRASH_REG_BATCH applies count operations in order, atomically with respect to the driver's
+// own register accesses. Writes only touch the bits in mask. Writes to the same register are
+// merged so each register is read at most once and written once, at the end of the batch or
+// before it is read back. A read returns the register value in value. Shadowed banks are never
+// read over the bus and their shadow is kept up to date. Merging makes this unsuitable for the
+// DMA command / status FIFOs, so DMA block registers are rejected. So is GLOBAL_BANK0, as
+// GLOBAL_RESET must go through CRASH_RESET, which waits for idle channels and reloads the shadow.
+#define CRASH_REG_BATCH_MAX               256
+#define CRASH_REG_OP_READ                 0
+#define CRASH_REG_OP_WRITE                1
+
+struct crash_reg_op {
+  uint32_t bank;                    // Register index, i.e. the _BASE of a field
+  uint32_t op;                      // CRASH_REG_OP_*
+  uint32_t mask;
+  uint32_t value;                   // In for writes, out for reads
+};
+
+struct crash_reg_batch {
+  uint64_t ops;                     // User pointer to struct crash_reg_op[count]
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Triggered register lists
+//
+// CRASH_TRIG_SET hands the driver a list of register writes to apply by itself when an event fires,
+// e.g. to hop USRP_RX_GAIN or USRP_RX_CIC_DECIM between bursts without waiting for userspace to be
+// scheduled. The count ops (CRASH_REG_OP_WRITE only) form nsteps steps of count / nsteps ops each.
+// Every every-th event runs the next step, wrapping around to the first, or with CRASH_TRIG_ONESHOT
+// stopping after the last. A step applies its writes in order without merging them, so a bit can be
+// pulsed, and an op with a zero mask does nothing, which pads a shorter step. Events:
+//   CRASH_TRIG_DMA_MM2S / CRASH_TRIG_DMA_S2MM  each DMA completed in that direction, seen on the
+//                                             interrupt path or when completions are polled
+//   CRASH_TRIG_THRESHOLD                      each spectrum sense threshold interrupt
+//   CRASH_TRIG_TIMER                          every period_us from start_ns (CLOCK_MONOTONIC, 0 for
+//                                             one period from now). Missed ticks still count.
+// More than nsteps events at once, e.g. completions polled late, run one pass over the steps that
+// ends where running all of them would have. Each device has CRASH_TRIG_MAX lists: id
+// CRASH_TRIG_NEW takes a free one and returns its id, an id the file descriptor already owns is
+// replaced. CRASH_TRIG_CLEAR (arg = id) removes a list, closing the file descriptor removes all of
+// its lists. Writes keep the shadow up to date like CRASH_REG_BATCH, DMA block registers and
+// GLOBAL_BANK0 are rejected.
+#define CRASH_TRIG_MAX                    8
+#define CRASH_TRIG_MAX_OPS                CRASH_REG_BATCH_MAX
+#define CRASH_TRIG_MIN_PERIOD_US          10
+#define CRASH_TRIG_NEW                    0xFFFFFFFF
+#define CRASH_TRIG_DMA_MM2S               0           // Same values as CRASH_DIR_*
+#define CRASH_TRIG_DMA_S2MM               1
+#define CRASH_TRIG_THRESHOLD              2
+#define CRASH_TRIG_TIMER                  3
+#define CRASH_TRIG_ONESHOT                (1 << 0)
+
+struct crash_trig {
+  uint64_t ops;                     // User pointer to struct crash_reg_op[count]
+  uint32_t count;
+  uint32_t nsteps;                  // Divides count
+  uint32_t event;                   // CRASH_TRIG_DMA_*, CRASH_TRIG_THRESHOLD or CRASH_TRIG_TIMER
+  uint32_t every;                   // Events per step, 0 or 1 for every event
+  uint32_t flags;                   // CRASH_TRIG_ONESHOT
+  uint32_t id;                      // CRASH_TRIG_NEW or a list to replace, out: id of the list
+  uint64_t start_ns;                // CRASH_TRIG_TIMER: first tick
+  uint32_t period_us;               // CRASH_TRIG_TIMER: at least CRASH_TRIG_MIN_PERIOD_US
+  uint32_t reserved;
+};
 
 // Macros to make reading / writing registers easier. Notice their input format matches the register definitions above.
 // The use of _full and _range versions allows us to avoid compiler warnings
@@ -501,6 +961,15 @@ extern "C" {
 #define crash_set_bit(reg,name)             reg[name##_BASE] = (reg[name##_BASE] | (1 << name##_OFFSET))
 #define crash_clear_bit(reg,name)           reg[name##_BASE] = (reg[name##_BASE] & ~(1 << name##_OFFSET))
 
+// Read a field of a shadowed bank from the MMAP_REGS_SHADOW mapping
+#define crash_read_reg_shadow(shadow,name)  ((shadow[name##_BASE] >> name##_OFFSET) & (uint32_t)((1ULL << name##_N)-1))
+#define crash_get_bit_shadow(shadow,name)   ((shadow[name##_BASE] >> name##_OFFSET) & 1)
+
+// Build a struct crash_reg_op for CRASH_REG_BATCH from a field name
+#define crash_reg_mask(name)                ((uint32_t)(((1ULL << name##_N)-1) << name##_OFFSET))
+#define crash_reg_op_read(name)             { name##_BASE, CRASH_REG_OP_READ, crash_reg_mask(name), 0 }
+#define crash_reg_op_write(name,val)        { name##_BASE, CRASH_REG_OP_WRITE, crash_reg_mask(name), ((uint32_t)(val) << name##_OFFSET) & crash_reg_mask(name) }
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,254 @@
+/******************************************************************************
+**  This is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this code.  If not, see <http://www.gnu.org/licenses/>.
+**
+**
+**
+**  File:         crash-kmod.hpp
+**  Author(s):    Jonathon Pendlum (jon.pendlum@gmail.com)
+**  Description:  Typed C++ access to the register map in crash-kmod.h.
+**
+******************************************************************************/
+#ifndef CRASH_KMOD_HPP
+#define CRASH_KMOD_HPP
+
+#include <stdint.h>
+#include "crash-kmod.h"
+
+// Every field of the register map is a type carrying its bank, shift and mask, so the
+// bank / mask arithmetic is done at compile time:
+//
+//   volatile uint32_t *regs = (uint32_t *)mmap(..., MMAP_REGS);
+//   uint32_t gain = crash::read<crash::USRP_RX_GAIN>(regs);
+//   crash::write(regs, crash::USRP_RX_CIC_BYPASS::val(0), crash::USRP_RX_HB_BYPASS::val(1));
+//
+// write() takes any number of values for fields of the same bank and turns them into one
+// store, preceded by one load only if the fields do not cover the whole bank. Mixing banks
+// or writing overlapping fields fails to compile.
+namespace crash {
+
+// Value of field F, already shifted into place in its bank
+template <typename F>
+struct field_value {
+  uint32_t bits;
+};
+
+template <uint32_t Bank, uint32_t Shift, uint32_t Width>
+struct field {
+  static_assert(Width > 0 && Shift + Width <= 32, "crash: field does not fit in a bank");
+  static constexpr uint32_t bank  = Bank;
+  static constexpr uint32_t shift = Shift;
+  static constexpr uint32_t width = Width;
+  static constexpr uint32_t mask  = (uint32_t)(((1ULL << Width) - 1) << Shift);
+
+  // Field value, positioned in the bank
+  static constexpr field_value<field> val(uint32_t v) { return field_value<field>{(v << Shift) & mask}; }
+  // Extract the field from a bank
+  static constexpr uint32_t get(uint32_t word) { return (word & mask) >> Shift; }
+};
+
+namespace detail {
+
+template <typename... Fs> struct fields;
+
+template <> struct fields<> {
+  static constexpr uint32_t mask = 0;
+};
+
+template <typename F, typename... Fs> struct fields<F, Fs...> {
+  static_assert((F::mask & fields<Fs...>::mask) == 0, "crash: fields written together overlap");
+  static constexpr uint32_t bank = F::bank;
+  static constexpr uint32_t mask = F::mask | fields<Fs...>::mask;
+};
+
+template <typename... Fs> struct same_bank;
+
+template <typename F> struct same_bank<F> {
+  static constexpr bool value = true;
+};
+
+template <typename F, typename G, typename... Fs> struct same_bank<F, G, Fs...> {
+  static constexpr bool value = F::bank == G::bank && same_bank<G, Fs...>::value;
+};
+
+constexpr uint32_t bits() { return 0; }
+
+template <typename F, typename... Fs>
+constexpr uint32_t bits(field_value<F> v, field_value<Fs>... vs) { return v.bits | bits(vs...); }
+
+} // namespace detail
+
+template <typename F>
+inline uint32_t read(volatile uint32_t *regs) { return F::get(regs[F::bank]); }
+
+// Read a field of a shadowed bank from the MMAP_REGS_SHADOW mapping
+template <typename F>
+inline uint32_t read_shadow(const uint32_t *shadow) { return F::get(shadow[F::bank]); }
+
+template <typename... Fs>
+inline void write(volatile uint32_t *regs, field_value<Fs>... vals)
+{
+  static_assert(detail::same_bank<Fs...>::value, "crash: fields written together must share a bank");
+  typedef detail::fields<Fs...> all;
+  if (all::mask == 0xFFFFFFFF) {
+    regs[all::bank] = detail::bits(vals...);
+  } else {
+    regs[all::bank] = (regs[all::bank] & ~all::mask) | detail::bits(vals...);
+  }
+}
+
+// A CRASH_REG_BATCH operation writing several fields of one bank
+template <typename... Fs>
+inline crash_reg_op reg_op(field_value<Fs>... vals)
+{
+  static_assert(detail::same_bank<Fs...>::value, "crash: fields written together must share a bank");
+  typedef detail::fields<Fs...> all;
+  crash_reg_op op = { all::bank, CRASH_REG_OP_WRITE, all::mask, detail::bits(vals...) };
+  return op;
+}
+
+#define CRASH_FIELD(name) typedef field<(name##_BASE), (name##_OFFSET), (name##_N)> name
+
+// -- DMA
+CRASH_FIELD(DMA_BANK0);
+CRASH_FIELD(DMA_MM2S_XFER_EN);
+CRASH_FIELD(DMA_S2MM_XFER_EN);
+CRASH_FIELD(DMA_RESET_MM2S_CMD_FIFO);
+CRASH_FIELD(DMA_RESET_S2MM_CMD_FIFO);
+CRASH_FIELD(DMA_MM2S_CMD_FIFO_LOOP);
+CRASH_FIELD(DMA_S2MM_CMD_FIFO_LOOP);
+CRASH_FIELD(DMA_STS_FIFO_AUTO_READ);
+CRASH_FIELD(DMA_RESET_STS_FIFO);
+CRASH_FIELD(DMA_CLEAR_MM2S_XFER_CNT);
+CRASH_FIELD(DMA_CLEAR_S2MM_XFER_CNT);
+CRASH_FIELD(DMA_MM2S_XFER_IN_PROGRESS);
+CRASH_FIELD(DMA_S2MM_XFER_IN_PROGRESS);
+CRASH_FIELD(DMA_BANK1);
+CRASH_FIELD(DMA_S2MM_INTERRUPT);
+CRASH_FIELD(DMA_MM2S_INTERRUPT);
+CRASH_FIELD(DMA_BANK2);
+CRASH_FIELD(DMA_MM2S_CMD_ADDR);
+CRASH_FIELD(DMA_BANK3);
+CRASH_FIELD(DMA_MM2S_CMD_DATA);
+CRASH_FIELD(DMA_MM2S_CMD_SIZE);
+CRASH_FIELD(DMA_MM2S_CMD_TDEST);
+CRASH_FIELD(DMA_MM2S_CMD_EN);
+CRASH_FIELD(DMA_BANK4);
+CRASH_FIELD(DMA_S2MM_CMD_ADDR);
+CRASH_FIELD(DMA_BANK5);
+CRASH_FIELD(DMA_S2MM_CMD_DATA);
+CRASH_FIELD(DMA_S2MM_CMD_SIZE);
+CRASH_FIELD(DMA_S2MM_CMD_TDEST);
+CRASH_FIELD(DMA_S2MM_CMD_EN);
+CRASH_FIELD(DMA_BANK6);
+CRASH_FIELD(DMA_MM2S_STS_FIFO);
+CRASH_FIELD(DMA_BANK7);
+CRASH_FIELD(DMA_S2MM_STS_FIFO);
+CRASH_FIELD(DMA_BANK8);
+CRASH_FIELD(DMA_MM2S_STS_FIFO_EMPTY);
+CRASH_FIELD(DMA_S2MM_STS_FIFO_EMPTY);
+CRASH_FIELD(DMA_BANK9);
+CRASH_FIELD(DMA_MM2S_CMD_FIFO_EMPTY);
+CRASH_FIELD(DMA_S2MM_CMD_FIFO_EMPTY);
+CRASH_FIELD(DMA_BANK10);
+CRASH_FIELD(DMA_MM2S_XFER_CNT);
+CRASH_FIELD(DMA_BANK11);
+CRASH_FIELD(DMA_S2MM_XFER_CNT);
+CRASH_FIELD(DMA_BANK12);
+CRASH_FIELD(DMA_CHECKWORD);
+CRASH_FIELD(DMA_BANK13);
+CRASH_FIELD(DMA_DEBUG_CNT);
+// -- USRP Interface
+CRASH_FIELD(USRP_BANK0);
+CRASH_FIELD(USRP_RX_ENABLE);
+CRASH_FIELD(USRP_TX_ENABLE);
+CRASH_FIELD(USRP_RX_ENABLE_SIDEBAND);
+CRASH_FIELD(USRP_TX_ENABLE_SIDEBAND);
+CRASH_FIELD(USRP_RX_FIFO_RESET);
+CRASH_FIELD(USRP_TX_FIFO_RESET);
+CRASH_FIELD(USRP_RX_FIFO_BYPASS);
+CRASH_FIELD(USRP_RX_FIFO_OVERFLOW_CLR);
+CRASH_FIELD(USRP_TX_FIFO_UNDERFLOW_CLR);
+CRASH_FIELD(USRP_AXIS_MASTER_TDEST);
+CRASH_FIELD(USRP_BANK1);
+CRASH_FIELD(USRP_USRP_MODE_CTRL);
+CRASH_FIELD(USRP_BANK2);
+CRASH_FIELD(USRP_RX_PACKET_SIZE);
+CRASH_FIELD(USRP_RX_FIX2FLOAT_BYPASS);
+CRASH_FIELD(USRP_RX_CIC_BYPASS);
+CRASH_FIELD(USRP_RX_HB_BYPASS);
+CRASH_FIELD(USRP_TX_FIX2FLOAT_BYPASS);
+CRASH_FIELD(USRP_TX_CIC_BYPASS);
+CRASH_FIELD(USRP_TX_HB_BYPASS);
+CRASH_FIELD(USRP_BANK3);
+CRASH_FIELD(USRP_RX_CIC_DECIM);
+CRASH_FIELD(USRP_TX_CIC_INTERP);
+CRASH_FIELD(USRP_BANK4);
+CRASH_FIELD(USRP_RX_GAIN);
+CRASH_FIELD(USRP_BANK5);
+CRASH_FIELD(USRP_TX_GAIN);
+CRASH_FIELD(USRP_BANK6);
+CRASH_FIELD(USRP_RX_RESET_CAL);
+CRASH_FIELD(USRP_RX_PHASE_INIT);
+CRASH_FIELD(USRP_TX_RESET_CAL);
+CRASH_FIELD(USRP_TX_PHASE_INIT);
+CRASH_FIELD(USRP_RX_PHASE_EN);
+CRASH_FIELD(USRP_RX_PHASE_INCDEC);
+CRASH_FIELD(USRP_TX_PHASE_EN);
+CRASH_FIELD(USRP_TX_PHASE_INCDEC);
+CRASH_FIELD(USRP_BANK7);
+CRASH_FIELD(USRP_CLOCK_LOCKED);
+CRASH_FIELD(USRP_RX_FIFO_OVERFLOW);
+CRASH_FIELD(USRP_TX_FIFO_UNDERFLOW);
+CRASH_FIELD(USRP_RX_CAL_COMPLETE);
+CRASH_FIELD(USRP_TX_CAL_COMPLETE);
+CRASH_FIELD(USRP_RX_PHASE_BUSY);
+CRASH_FIELD(USRP_TX_PHASE_BUSY);
+CRASH_FIELD(USRP_UART_BUSY);
+CRASH_FIELD(USRP_CLK_RX_PHASE);
+CRASH_FIELD(USRP_CLK_TX_PHASE);
+// -- Spectrum Sense
+CRASH_FIELD(SPEC_SENSE_BANK0);
+CRASH_FIELD(SPEC_SENSE_ENABLE_FFT);
+CRASH_FIELD(SPEC_SENSE_AXIS_MASTER_TDEST);
+CRASH_FIELD(SPEC_SENSE_BANK1);
+CRASH_FIELD(SPEC_SENSE_AXIS_CONFIG_TDATA);
+CRASH_FIELD(SPEC_SENSE_AXIS_CONFIG_TVALID);
+CRASH_FIELD(SPEC_SENSE_OUTPUT_MODE);
+CRASH_FIELD(SPEC_SENSE_ENABLE_THRESHOLD_IRQ);
+CRASH_FIELD(SPEC_SENSE_ENABLE_THRESH_SIDEBAND);
+CRASH_FIELD(SPEC_SENSE_ENABLE_NOT_THRESH_SIDEBAND);
+CRASH_FIELD(SPEC_SENSE_CLEAR_THRESHOLD_LATCHED);
+CRASH_FIELD(SPEC_SENSE_BANK2);
+CRASH_FIELD(SPEC_SENSE_THRESHOLD);
+CRASH_FIELD(SPEC_SENSE_BANK3);
+CRASH_FIELD(SPEC_SENSE_THRESHOLD_EXCEEDED_INDEX);
+CRASH_FIELD(SPEC_SENSE_THRESHOLD_EXCEEDED);
+CRASH_FIELD(SPEC_SENSE_BANK4);
+CRASH_FIELD(SPEC_SENSE_THRESHOLD_EXCEEDED_MAG);
+// -- Global
+CRASH_FIELD(GLOBAL_BANK0);
+CRASH_FIELD(GLOBAL_RESET);
+CRASH_FIELD(GLOBAL_BANK1);
+CRASH_FIELD(GLOBAL_M_AXI_AWPROT);
+CRASH_FIELD(GLOBAL_M_AXI_AWCACHE);
+CRASH_FIELD(GLOBAL_M_AXI_AWUSER);
+CRASH_FIELD(GLOBAL_M_AXI_ARPROT);
+CRASH_FIELD(GLOBAL_M_AXI_ARCACHE);
+CRASH_FIELD(GLOBAL_M_AXI_ARUSER);
+
+#undef CRASH_FIELD
+
+} // namespace crash
+
+#endif